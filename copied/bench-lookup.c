@@ -0,0 +1,148 @@
+/* bench-lookup.c: time resolving request urls to repositories
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ *
+ * Usage: bench-lookup [repos [lookups]]
+ *
+ * Builds a synthetic repolist of 'repos' urls (default 10000) nested one
+ * to three levels deep, like Gerrit project names, and resolves 'lookups'
+ * request urls (default 100000) against it: repository urls followed by a
+ * page and a path, plus one in ten that names no repository. They are
+ * resolved once with a walk over the repolist at every '/', as
+ * cgit_parse_url() does with cgit_get_repoinfo(), and once through
+ * cgit_lookup_url(). Both must agree.
+ */
+
+#include "cgit.h"
+#include "repo-index.h"
+
+struct cgit_repolist cgit_repolist;
+struct cgit_context ctx;
+
+static const char *pages[] = {
+	"", "/log", "/tree/src/main.c", "/commit", "/log/Documentation/"
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void add_repo(const char *url)
+{
+	struct cgit_repo *repo;
+
+	if (cgit_repolist.count >= cgit_repolist.length) {
+		cgit_repolist.length = alloc_nr(cgit_repolist.length);
+		cgit_repolist.repos = xrealloc(cgit_repolist.repos,
+					       cgit_repolist.length *
+					       sizeof(struct cgit_repo));
+	}
+	repo = &cgit_repolist.repos[cgit_repolist.count++];
+	memset(repo, 0, sizeof(*repo));
+	repo->url = xstrdup(url);
+}
+
+static struct cgit_repo *linear_repo(const char *url)
+{
+	int i;
+
+	for (i = 0; i < cgit_repolist.count; i++)
+		if (!strcmp(cgit_repolist.repos[i].url, url))
+			return &cgit_repolist.repos[i];
+	return NULL;
+}
+
+/* The walk cgit_parse_url() makes through cgit_get_repoinfo(). */
+static struct cgit_repo *linear_url(const char *url)
+{
+	struct cgit_repo *repo;
+	char *buf, *p;
+
+	repo = linear_repo(url);
+	if (repo)
+		return repo;
+	buf = xstrdup(url);
+	for (p = strchr(buf, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		repo = linear_repo(buf);
+		*p = '/';
+		if (repo)
+			break;
+	}
+	free(buf);
+	return repo;
+}
+
+int main(int argc, char **argv)
+{
+	int nrepos = argc > 1 ? atoi(argv[1]) : 10000;
+	int nlookups = argc > 2 ? atoi(argv[2]) : 100000;
+	struct strbuf url = STRBUF_INIT;
+	struct cgit_repo **expected;
+	char **urls;
+	uint64_t start, linear_ns, hashed_ns;
+	size_t len;
+	int i, found = 0;
+
+	if (nrepos <= 0 || nlookups <= 0) {
+		fprintf(stderr, "usage: %s [repos [lookups]]\n", argv[0]);
+		return 2;
+	}
+	for (i = 0; i < nrepos; i++) {
+		strbuf_reset(&url);
+		switch (i % 3) {
+		case 0:
+			strbuf_addf(&url, "project-%d", i);
+			break;
+		case 1:
+			strbuf_addf(&url, "team-%d/project-%d", i % 97, i);
+			break;
+		default:
+			strbuf_addf(&url, "platform/team-%d/project-%d.git",
+				    i % 31, i);
+		}
+		add_repo(url.buf);
+	}
+
+	urls = xcalloc(nlookups, sizeof(*urls));
+	expected = xcalloc(nlookups, sizeof(*expected));
+	srand(1);
+	for (i = 0; i < nlookups; i++) {
+		strbuf_reset(&url);
+		if (i % 10 == 9)
+			strbuf_addf(&url, "team-%d/missing-%d/log", i % 97, i);
+		else
+			strbuf_addstr(&url, cgit_repolist.repos[rand() % nrepos].url);
+		strbuf_addstr(&url, pages[i % ARRAY_SIZE(pages)]);
+		urls[i] = strbuf_detach(&url, NULL);
+	}
+
+	start = now_ns();
+	for (i = 0; i < nlookups; i++)
+		expected[i] = linear_url(urls[i]);
+	linear_ns = now_ns() - start;
+
+	/* The index is built by the first lookup, which is timed as well. */
+	start = now_ns();
+	for (i = 0; i < nlookups; i++) {
+		if (cgit_lookup_url(urls[i], &len) != expected[i]) {
+			fprintf(stderr, "mismatch for %s\n", urls[i]);
+			return 1;
+		}
+		if (expected[i])
+			found++;
+	}
+	hashed_ns = now_ns() - start;
+
+	printf("%d repos, %d lookups (%d found)\n", nrepos, nlookups, found);
+	printf("linear: %10.3f ms %10.1f ns/lookup\n", linear_ns / 1e6,
+	       (double)linear_ns / nlookups);
+	printf("hashed: %10.3f ms %10.1f ns/lookup\n", hashed_ns / 1e6,
+	       (double)hashed_ns / nlookups);
+	return 0;
+}
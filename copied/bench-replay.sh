@@ -0,0 +1,135 @@
+#!/bin/sh
+#
+# bench-replay.sh: replay the requests of an access log against cgit
+#
+# Usage: bench-replay.sh [-c concurrency] [-n requests] [-p prefix]
+#                        <cgit> <cgitrc> <access_log>
+#
+# Takes the GET requests for 'prefix' (default /cgit.cgi) from an access
+# log in Apache's common or combined format and runs each of them through
+# "cgit --query=..." with 'cgitrc', first with the page cache off and then
+# with an empty one. The cgitrc should point scan-path at a local copy of
+# the repositories. Reported per page: the number of requests, p50/p95/p99
+# latency in milliseconds (from the server-timing log line, i.e. without
+# exec and startup), and the cache hit ratio; and the throughput of each run.
+#
+# Licensed under GNU General Public License v2
+#   (see COPYING for full license text)
+
+concurrency=4
+requests=0
+prefix=/cgit.cgi
+
+while getopts c:n:p: opt
+do
+	case $opt in
+	c) concurrency=$OPTARG ;;
+	n) requests=$OPTARG ;;
+	p) prefix=$OPTARG ;;
+	*) exit 2 ;;
+	esac
+done
+shift $(($OPTIND - 1))
+if test $# -ne 3
+then
+	echo "usage: $0 [-c concurrency] [-n requests] [-p prefix] <cgit> <cgitrc> <access_log>" >&2
+	exit 2
+fi
+cgit=$1
+cgitrc=$2
+log=$3
+case $cgit in /*) ;; *) cgit=$PWD/$cgit ;; esac
+case $cgitrc in /*) ;; *) cgitrc=$PWD/$cgitrc ;; esac
+
+work=`mktemp -d "${TMPDIR:-/tmp}/bench-replay.XXXXXX"` || exit 1
+trap 'rm -rf "$work"' EXIT
+
+# One query per request: the path below 'prefix' becomes url=, like
+# PATH_INFO does, and the query string follows.
+awk -v prefix="$prefix" -v max="$requests" '
+{
+	if (!match($0, /"GET [^ "]*/))
+		next
+	target = substr($0, RSTART + 5, RLENGTH - 5)
+	if (substr(target, 1, length(prefix)) != prefix)
+		next
+	target = substr(target, length(prefix) + 1)
+	q = index(target, "?")
+	path = q ? substr(target, 1, q - 1) : target
+	query = q ? substr(target, q + 1) : ""
+	sub(/^\//, "", path)
+	if (path != "")
+		query = "url=" path (query != "" ? "&" query : "")
+	print query
+	if (max > 0 && ++n >= max)
+		exit
+}' "$log" >"$work/queries"
+
+total=`wc -l <"$work/queries"`
+if test "$total" -eq 0
+then
+	echo "no GET requests for $prefix in $log" >&2
+	exit 1
+fi
+
+# Run the queries of one worker, every concurrency'th line from 'start'.
+worker () {
+	awk -v n="$concurrency" -v i="$1" 'NR % n == i' "$work/queries" |
+	while IFS= read -r query
+	do
+		CGIT_CONFIG="$2" "$cgit" --query="$query" >/dev/null
+	done 2>&1 | grep '^\[cgit\] timing ' >"$3"
+}
+
+# $1: name of the run, $2: cache-size. The settings come both before the
+# included cgitrc, for scan-path, and after it, to win over its own.
+run () {
+	rm -rf "$work/cache"
+	mkdir "$work/cache"
+	cat >"$work/cgitrc" <<-EOF
+	cache-root=$work/cache
+	cache-size=$2
+	include=$cgitrc
+	cache-root=$work/cache
+	cache-size=$2
+	server-timing=1
+	EOF
+	start=`date +%s.%N`
+	i=0
+	while test $i -lt $concurrency
+	do
+		worker $i "$work/cgitrc" "$work/$1.$i" &
+		i=$(($i + 1))
+	done
+	wait
+	end=`date +%s.%N`
+
+	echo "$1: $total requests, concurrency $concurrency," \
+		`echo "$start $end $total" | awk '{ printf "%.1f requests/s", $3 / ($2 - $1) }'`
+	cat "$work/$1".* |
+	awk '{
+		for (i = 3; i <= NF; i++) {
+			split($i, kv, "=")
+			f[kv[1]] = kv[2]
+		}
+		print f["page"], f["total"], f["cached"]
+	}' | sort -k1,1 -k2,2n |
+	awk '
+	function report() {
+		if (!n)
+			return
+		printf "  %-10s %6d %9.3f %9.3f %9.3f %6.1f%%\n", page, n,
+			t[int((n - 1) * 0.50) + 1], t[int((n - 1) * 0.95) + 1],
+			t[int((n - 1) * 0.99) + 1], 100 * hits / n
+	}
+	BEGIN {
+		printf "  %-10s %6s %9s %9s %9s %7s\n", "page", "count",
+			"p50 ms", "p95 ms", "p99 ms", "hits"
+	}
+	$1 != page { report(); page = $1; n = 0; hits = 0 }
+	{ t[++n] = $2; if ($3 == "hit") hits++ }
+	END { report() }'
+}
+
+run nocache 0
+run cache 1000
@@ -9,6 +9,10 @@
 
 #include "cgit.h"
 #include "cache.h"
+#include "page-cache.h"
+#include "repo-state.h"
+#include "metrics.h"
+#include "timing.h"
 #include "cmd.h"
 #include "configfile.h"
 #include "html.h"
@@ -17,11 +21,13 @@
 #include "ui-blob.h"
 #include "ui-summary.h"
 #include "scan-tree.h"
+#include "repo-index.h"
+#include "repo-cache.h"
+#include "scgi.h"
 
 /* cherry */
 #include "gerrit_curl.h" 
 #include <jansson.h>
-int gerrit_scan_projects(const char *path, const char *data, repo_config_fn fn);
 /* //cherry */
 
 
@@ -66,7 +72,48 @@ static struct cgit_filter *new_filter(const char *cmd, filter_type filtertype)
 	return f;
 }
 
-static void process_cached_repolist(const char *path);
+static int process_cached_repolist(const char *path);
+static void scan_repolist(const char *path);
+
+/* Set when the Gerrit ACL isn't applied while parsing cgitrc: an SCGI pool
+ * applies it per request (see scgi_worker()), the watcher not at all.
+ */
+static int gerrit_deferred;
+
+/* Set once a scan-path was filtered by the Gerrit ACL: the repolist then
+ * depends on the user, see page_cache_key().
+ */
+static int gerrit_acl;
+
+/* Set while a reloading pool or the watcher load the repolist: regenerate
+ * the cached repolist instead of using it.
+ */
+static int rescan_repolist;
+
+/* Set by --watch: scan-path only collects the paths to watch. */
+static int watch_mode;
+
+/* Set by --metrics: print the metrics, scan-path is skipped. */
+static int metrics_mode;
+static struct string_list watch_paths = STRING_LIST_INIT_DUP;
+static const char *watch_pidfile;
+
+/* --scgi-workers was given and overrides cgitrc. */
+static int scgi_workers_arg;
+static int scan_threads_arg;
+
+/* In SCGI mode the Gerrit ACL depends on the request, so scan-path only
+ * loads the repositories and the filtering is deferred to each request.
+ * 'start' is the first repolist entry to filter, or -1 if the visible
+ * projects have to be scanned one by one instead.
+ */
+static struct {
+	char *path;
+	int start;
+} gerrit_scan;
+
+static void fetch_gerrit_projects(const char *path, int start,
+				  struct gerrit_project_list *list);
 
 static void repo_config(struct cgit_repo *repo, const char *name, const char *value)
 {
@@ -250,28 +297,88 @@ static void config_cb(const char *name, const char *value)
 		ctx.cfg.gerrit_index_url = xstrdup(expand_macros(value));
 	else if (!strcmp(name, "gerrit-cgit-url"))
 		ctx.cfg.gerrit_cgit_url = xstrdup(expand_macros(value));
+	else if (!strcmp(name, "gerrit-project-list-ttl"))
+		ctx.cfg.gerrit_project_list_ttl = atoi(value);
+	else if (!strcmp(name, "gerrit-connect-timeout"))
+		ctx.cfg.gerrit_connect_timeout = atoi(value);
+	else if (!strcmp(name, "gerrit-timeout"))
+		ctx.cfg.gerrit_timeout = atoi(value);
+	else if (!strcmp(name, "gerrit-breaker-failures"))
+		ctx.cfg.gerrit_breaker_failures = atoi(value);
+	else if (!strcmp(name, "gerrit-breaker-cooldown"))
+		ctx.cfg.gerrit_breaker_cooldown = atoi(value);
+	else if (!strcmp(name, "scgi-max-requests"))
+		ctx.cfg.scgi_max_requests = atoi(value);
+	else if (!strcmp(name, "scgi-workers") && !scgi_workers_arg)
+		ctx.cfg.scgi_workers = atoi(value);
+	else if (!strcmp(name, "scan-watch-delay"))
+		ctx.cfg.scan_watch_delay = atoi(value);
+	else if (!strcmp(name, "scan-threads") && !scan_threads_arg)
+		ctx.cfg.scan_threads = atoi(value);
+	else if (!strcmp(name, "cache-shards"))
+		ctx.cfg.cache_shards = atoi(value);
+	else if (!strcmp(name, "cache-shard-size"))
+		ctx.cfg.cache_shard_size = atoi(value);
+	else if (!strcmp(name, "cache-ref-ttl"))
+		ctx.cfg.cache_ref_ttl = atoi(value);
+	else if (!strcmp(name, "buffer-output"))
+		ctx.cfg.buffer_output = atoi(value);
+	else if (!strcmp(name, "server-timing"))
+		ctx.cfg.server_timing = atoi(value);
+	else if (!strcmp(name, "server-timing-allow"))
+		ctx.cfg.server_timing_allow = xstrdup(value);
+	else if (!strcmp(name, "metrics"))
+		ctx.cfg.metrics = atoi(value);
+	else if (!strcmp(name, "metrics-allow"))
+		ctx.cfg.metrics_allow = xstrdup(value);
 	/* //CHERRY */
 	else if (!strcmp(name, "scan-path")) {
-		if (!ctx.cfg.nocache && ctx.cfg.cache_size) {
-			process_cached_repolist(expand_macros(value));
-		}
+		if (watch_mode)
+			string_list_append(&watch_paths, expand_macros(value));
+		else if (metrics_mode)
+			;
 		/* SPIN */
 		//else if (ctx.cfg.gerrit_project_list_url) {
 		else if( (ctx.cfg.gerrit_project_list_url)  && (ctx.cfg.gerrit_login_url) && (ctx.cfg.gerrit_index_url) && (ctx.cfg.gerrit_cgit_url) ) {
+			int idx = cgit_repolist.count;
+
+			gerrit_acl = 1;
 
 #if MYDEBUG
 			fprintf(stderr, "DEBUG get_project_list_url ->%s<-\n", ctx.cfg.gerrit_project_list_url);
 #endif
-			gerrit_get_project_list(expand_macros(value), &ctx, repo_config);
+			/* The cached repolist holds every repository below
+			 * scan-path; the user's Gerrit project list only picks
+			 * the visible ones out of it.
+			 */
+			if (gerrit_deferred) {
+				gerrit_scan.path = xstrdup(expand_macros(value));
+				gerrit_scan.start = -1;
+				if (!ctx.cfg.nocache && !process_cached_repolist(gerrit_scan.path))
+					gerrit_scan.start = idx;
+			} else {
+				struct gerrit_project_list list;
+				char *path = xstrdup(expand_macros(value));
+
+				if (!ctx.cfg.nocache && !process_cached_repolist(path)) {
+					fetch_gerrit_projects(path, idx, &list);
+					gerrit_apply_project_list(&list, NULL, &ctx, idx, NULL);
+				} else {
+					fetch_gerrit_projects(path, -1, &list);
+					gerrit_apply_project_list(&list, path, &ctx, 0, repo_config);
+				}
+				gerrit_release_project_list(&list);
+				free(path);
+			}
+			ctx.repo = NULL;
 		}
 		/* //SPIN */
-		else if (ctx.cfg.project_list) {
-			fprintf(stderr,"project_list found\n");
-			scan_projects(expand_macros(value), ctx.cfg.project_list, repo_config);
-		}
-		else {
-			scan_tree(expand_macros(value), repo_config);
+		else if (!ctx.cfg.nocache && ctx.cfg.cache_size) {
+			if (process_cached_repolist(expand_macros(value)))
+				scan_repolist(expand_macros(value));
 		}
+		else
+			scan_repolist(expand_macros(value));
 	}
 	else if (!strcmp(name, "scan-hidden-path"))
 		ctx.cfg.scan_hidden_path = atoi(value);
@@ -323,6 +430,44 @@ static void config_cb(const char *name, const char *value)
 		parse_configfile(expand_macros(value), config_cb);
 }
 
+/*
+ * url syntax: [repo ['/' cmd [ '/' path]]]
+ *   repo: any valid repo url, may contain '/'
+ *   cmd:  log | commit | diff | tree | view | blob | snapshot
+ *   path: any valid path, may contain '/'
+ *
+ * Same as cgit_parse_url(), but the repository is found through the hashed
+ * repo index, see cgit_lookup_url().
+ */
+static void parse_url(const char *url)
+{
+	char *buf, *cmd, *p;
+	size_t len;
+
+	ctx.repo = NULL;
+	if (!url || url[0] == '\0')
+		return;
+
+	ctx.repo = cgit_lookup_url(url, &len);
+	if (!ctx.repo)
+		return;
+	ctx.qry.repo = ctx.repo->url;
+	if (!url[len])
+		return;
+
+	buf = xstrdup(url + len + 1);
+	cmd = buf;
+	p = strchr(cmd, '/');
+	if (p) {
+		*p = '\0';
+		if (p[1])
+			ctx.qry.path = trim_end(p + 1, '/');
+	}
+	if (cmd[0])
+		ctx.qry.page = xstrdup(cmd);
+	free(buf);
+}
+
 static void querystring_cb(const char *name, const char *value)
 {
 	if (!value)
@@ -330,14 +475,14 @@ static void querystring_cb(const char *name, const char *value)
 
 	if (!strcmp(name,"r")) {
 		ctx.qry.repo = xstrdup(value);
-		ctx.repo = cgit_get_repoinfo(value);
+		ctx.repo = cgit_lookup_repo(value);
 	} else if (!strcmp(name, "p")) {
 		ctx.qry.page = xstrdup(value);
 	} else if (!strcmp(name, "url")) {
 		if (*value == '/')
 			value++;
 		ctx.qry.url = xstrdup(value);
-		cgit_parse_url(value);
+		parse_url(value);
 	} else if (!strcmp(name, "qt")) {
 		ctx.qry.grep = xstrdup(value);
 	} else if (!strcmp(name, "q")) {
@@ -377,6 +522,8 @@ static void querystring_cb(const char *name, const char *value)
 	}
 }
 
+static void prepare_request(struct cgit_context *ctx);
+
 static void prepare_context(struct cgit_context *ctx)
 {
 	memset(ctx, 0, sizeof(*ctx));
@@ -390,6 +537,11 @@ static void prepare_context(struct cgit_context *ctx)
 	ctx->cfg.cache_root_ttl = 5;
 	ctx->cfg.cache_scanrc_ttl = 15;
 	ctx->cfg.cache_static_ttl = -1;
+	ctx->cfg.gerrit_project_list_ttl = 0;
+	ctx->cfg.gerrit_connect_timeout = 5;
+	ctx->cfg.gerrit_timeout = 15;
+	ctx->cfg.gerrit_breaker_failures = 5;
+	ctx->cfg.gerrit_breaker_cooldown = 60;
 	ctx->cfg.case_sensitive_sort = 1;
 	ctx->cfg.branch_sort = 0;
 	ctx->cfg.commit_sort = 0;
@@ -423,6 +575,27 @@ static void prepare_context(struct cgit_context *ctx)
 	ctx->cfg.summary_tags = 10;
 	ctx->cfg.max_atom_items = 10;
 	ctx->cfg.ssdiff = 0;
+	ctx->cfg.scgi_max_requests = 0;
+	ctx->cfg.scgi_workers = 1;
+	ctx->cfg.scan_watch_delay = 2;
+	ctx->cfg.scan_threads = 1;
+	ctx->cfg.cache_shards = 0;
+	ctx->cfg.cache_shard_size = 64;
+	ctx->cfg.cache_ref_ttl = 0;
+	ctx->cfg.buffer_output = 1;
+	memset(&ctx->cfg.mimetypes, 0, sizeof(struct string_list));
+	prepare_request(ctx);
+}
+
+/* Reset everything that is derived from the request: the environment, the
+ * query and the page. The configuration is left alone.
+ */
+static void prepare_request(struct cgit_context *ctx)
+{
+	memset(&ctx->env, 0, sizeof(ctx->env));
+	memset(&ctx->qry, 0, sizeof(ctx->qry));
+	memset(&ctx->page, 0, sizeof(ctx->page));
+	ctx->repo = NULL;
 	ctx->env.cgit_config = getenv("CGIT_CONFIG");
 	ctx->env.http_host = getenv("HTTP_HOST");
 	ctx->env.https = getenv("HTTPS");
@@ -440,7 +613,6 @@ static void prepare_context(struct cgit_context *ctx)
 	ctx->page.modified = time(NULL);
 	ctx->page.expires = ctx->page.modified;
 	ctx->page.etag = NULL;
-	memset(&ctx->cfg.mimetypes, 0, sizeof(struct string_list));
 	if (ctx->env.script_name)
 		ctx->cfg.script_name = xstrdup(ctx->env.script_name);
 	if (ctx->env.query_string)
@@ -647,10 +819,141 @@ static int prepare_repo_cmd(struct cgit_context *ctx)
 	return 0;
 }
 
+/* The page asked for: the url with the parameters of its query sorted, so
+ * that the same page always gets the same ETag. Like querystring_cb(), the
+ * last of repeated parameters wins and the others are dropped.
+ */
+static void normalized_query(const char *raw, struct strbuf *out)
+{
+	struct string_list params = STRING_LIST_INIT_NODUP;
+	struct string_list_item *item;
+	const char *query, *p, *end;
+	char *param, sep = '?';
+	size_t namelen;
+	int i;
+
+	if (!raw)
+		raw = "";
+	query = strchrnul(raw, '?');
+	strbuf_add(out, raw, query - raw);
+	for (p = query; *p; p = end) {
+		p++;
+		end = strchrnul(p, '&');
+		if (end == p)
+			continue;
+		param = xstrndup(p, end - p);
+		namelen = strcspn(param, "=");
+		for (i = 0; i < params.nr; i++)
+			if (strcspn(params.items[i].string, "=") == namelen &&
+			    !strncmp(params.items[i].string, param, namelen))
+				break;
+		if (i < params.nr) {
+			free(params.items[i].string);
+			params.items[i].string = param;
+		} else
+			string_list_append(&params, param)->util = NULL;
+	}
+	sort_string_list(&params);
+	for_each_string_list_item(item, &params) {
+		strbuf_addch(out, sep);
+		strbuf_addstr(out, item->string);
+		sep = '&';
+	}
+	params.strdup_strings = 1;
+	string_list_clear(&params, 0);
+}
+
+/* Strong validators for a page about a repository. The ETag covers the
+ * cgit version, cgitrc, the page asked for and the state of the
+ * repository's refs and settings, i.e. everything the page is rendered
+ * from besides objects named by their id. Last-Modified is the newest
+ * change among the refs, the settings and cgitrc.
+ */
+static void set_validators(struct cgit_context *ctx)
+{
+	static char etag[41];
+	struct strbuf query = STRBUF_INIT;
+	struct repo_state state;
+	unsigned char sha1[20];
+	struct stat st;
+	git_SHA_CTX c;
+
+	if (!ctx->repo || ctx->page.etag || repo_state(ctx->repo->path, &state))
+		return;
+	git_SHA1_Init(&c);
+	git_SHA1_Update(&c, cgit_version, strlen(cgit_version) + 1);
+	if (ctx->env.cgit_config && !stat(ctx->env.cgit_config, &st)) {
+		git_SHA1_Update(&c, &st.st_mtime, sizeof(st.st_mtime));
+		if (st.st_mtime > state.modified)
+			state.modified = st.st_mtime;
+	}
+	git_SHA1_Update(&c, ctx->repo->url, strlen(ctx->repo->url) + 1);
+	normalized_query(ctx->qry.raw, &query);
+	git_SHA1_Update(&c, query.buf, query.len + 1);
+	git_SHA1_Update(&c, state.sha1, sizeof(state.sha1));
+	git_SHA1_Final(sha1, &c);
+	strbuf_release(&query);
+
+	memcpy(etag, sha1_to_hex(sha1), sizeof(etag));
+	ctx->page.etag = etag;
+	if (state.modified)
+		ctx->page.modified = state.modified;
+}
+
+/* Whether 'etag' is in the If-None-Match list 'match'. The gzip variant of a
+ * cached page has "-gz" appended to it, see gzip_page().
+ */
+static int etag_matches(const char *match, const char *etag)
+{
+	size_t len = strlen(etag);
+	const char *p = match;
+
+	while (*p) {
+		p += strspn(p, " \t,");
+		if (*p == '*')
+			return 1;
+		if (!prefixcmp(p, "W/"))
+			p += 2;
+		if (*p == '"' && !strncmp(p + 1, etag, len) &&
+		    (p[len + 1] == '"' || !prefixcmp(p + len + 1, "-gz\"")))
+			return 1;
+		p += strcspn(p, ",");
+	}
+	return 0;
+}
+
+/* Whether the copy the client has is still current. If-None-Match wins
+ * over If-Modified-Since when both are given.
+ */
+static int not_modified(struct cgit_context *ctx)
+{
+	const char *match = getenv("HTTP_IF_NONE_MATCH");
+	const char *since = getenv("HTTP_IF_MODIFIED_SINCE");
+	unsigned long time;
+	int offset;
+
+	if (!ctx->page.etag)
+		return 0;
+	if (match)
+		return etag_matches(match, ctx->page.etag);
+	if (since && !parse_date_basic(since, &time, &offset))
+		return ctx->page.modified <= time;
+	return 0;
+}
+
 static void process_request(void *cbdata)
 {
 	struct cgit_context *ctx = cbdata;
 	struct cgit_cmd *cmd;
+	int err;
+
+	/* Repositories found by scan-path have their settings read when
+	 * they are shown, i.e. the selected one or all of them.
+	 */
+	if (ctx->repo) {
+		scan_tree_load(ctx->repo);
+		set_validators(ctx);
+	}
 
 	cmd = cgit_get_cmd(ctx);
 	if (!cmd) {
@@ -685,8 +988,16 @@ static void process_request(void *cbdata)
 		return;
 	}
 
-	if (ctx->repo && prepare_repo_cmd(ctx))
-		return;
+	if (ctx->repo) {
+		timing_begin(TIMING_PREPARE);
+		err = prepare_repo_cmd(ctx);
+		timing_end(TIMING_PREPARE);
+		if (err)
+			return;
+	}
+
+	if (!ctx->repo)
+		scan_tree_load_all();
 
 	if (cmd->want_layout) {
 		cgit_print_http_headers(ctx);
@@ -694,7 +1005,9 @@ static void process_request(void *cbdata)
 		cgit_print_pageheader(ctx);
 	}
 
+	timing_begin(TIMING_RENDER);
 	cmd->fn(ctx);
+	timing_end(TIMING_RENDER);
 
 	if (cmd->want_layout)
 		cgit_print_docend();
@@ -733,6 +1046,7 @@ static char *get_first_line(char *txt)
 static void print_repo(FILE *f, struct cgit_repo *repo)
 {
 	struct string_list_item *item;
+	scan_tree_load(repo);
 	fprintf(f, "repo.url=%s\n", repo->url);
 	fprintf(f, "repo.name=%s\n", repo->name);
 	fprintf(f, "repo.path=%s\n", repo->path);
@@ -802,12 +1116,199 @@ static void print_repolist(FILE *f, struct cgit_repolist *list, int start)
 		print_repo(f, &list->repos[i]);
 }
 
+static void pack_setting(struct strbuf *buf, struct repo_cache_record *rec,
+			 const char *name, const char *value)
+{
+	strbuf_add(buf, name, strlen(name) + 1);
+	strbuf_add(buf, value, strlen(value) + 1);
+	rec->nsettings++;
+}
+
+/* Binary counterpart of print_repo(), loaded again by add_cached_repos(). */
+static void pack_repo(struct repo_cache_writer *w, struct cgit_repo *repo)
+{
+	struct repo_cache_record rec;
+	struct strbuf buf = STRBUF_INIT;
+	struct string_list_item *item;
+	char *tmp;
+
+	scan_tree_load(repo);
+	memset(&rec, 0, sizeof(rec));
+	rec.url = repo_cache_add_string(w, repo->url);
+	rec.name = repo_cache_add_string(w, repo->name);
+	tmp = trim_end(repo->path, '/');
+	rec.path = repo_cache_add_string(w, tmp);
+	free(tmp);
+	rec.owner = repo_cache_add_string(w, repo->owner);
+	if (repo->desc) {
+		tmp = get_first_line(repo->desc);
+		rec.desc = repo_cache_add_string(w, tmp);
+		free(tmp);
+	}
+	for_each_string_list_item(item, &repo->readme) {
+		if (item->util)
+			strbuf_addf(&buf, "%s:%s", (char *)item->util, item->string);
+		else
+			strbuf_addstr(&buf, item->string);
+		strbuf_addch(&buf, '\0');
+		rec.nreadme++;
+	}
+	rec.readme = repo_cache_add_strings(w, &buf);
+	strbuf_reset(&buf);
+	rec.defbranch = repo_cache_add_string(w, repo->defbranch);
+	rec.module_link = repo_cache_add_string(w, repo->module_link);
+	rec.section = repo_cache_add_string(w, repo->section);
+	rec.clone_url = repo_cache_add_string(w, repo->clone_url);
+	rec.logo = repo_cache_add_string(w, repo->logo);
+	rec.logo_link = repo_cache_add_string(w, repo->logo_link);
+	rec.enable_commit_graph = repo->enable_commit_graph;
+	rec.enable_log_filecount = repo->enable_log_filecount;
+	rec.enable_log_linecount = repo->enable_log_linecount;
+	rec.enable_remote_branches = repo->enable_remote_branches;
+	rec.enable_subject_links = repo->enable_subject_links;
+
+	if (repo->about_filter && repo->about_filter != ctx.cfg.about_filter)
+		pack_setting(&buf, &rec, "about-filter", repo->about_filter->cmd);
+	if (repo->commit_filter && repo->commit_filter != ctx.cfg.commit_filter)
+		pack_setting(&buf, &rec, "commit-filter", repo->commit_filter->cmd);
+	if (repo->source_filter && repo->source_filter != ctx.cfg.source_filter)
+		pack_setting(&buf, &rec, "source-filter", repo->source_filter->cmd);
+	if (repo->snapshots != ctx.cfg.snapshots) {
+		tmp = build_snapshot_setting(repo->snapshots);
+		pack_setting(&buf, &rec, "snapshots", tmp ? tmp : "");
+		free(tmp);
+	}
+	if (repo->max_stats != ctx.cfg.max_stats)
+		pack_setting(&buf, &rec, "max-stats",
+			     cgit_find_stats_periodname(repo->max_stats));
+	if (repo->branch_sort == 1)
+		pack_setting(&buf, &rec, "branch-sort", "age");
+	if (repo->commit_sort == 1)
+		pack_setting(&buf, &rec, "commit-sort", "date");
+	else if (repo->commit_sort == 2)
+		pack_setting(&buf, &rec, "commit-sort", "topo");
+	rec.settings = repo_cache_add_strings(w, &buf);
+	strbuf_release(&buf);
+	repo_cache_add_record(w, &rec);
+}
+
+/* Write the binary cached repolist for the text one, which is 'rc_size'
+ * bytes. Any old binary cache is removed if that fails.
+ */
+static void write_repo_cache(const char *cached_rc, struct cgit_repolist *list,
+			     int start, long rc_size)
+{
+	struct repo_cache_writer w;
+	struct strbuf filename = STRBUF_INIT;
+	int i;
+
+	strbuf_addf(&filename, "%s.bin", cached_rc);
+	repo_cache_writer_init(&w);
+	for (i = start; i < list->count; i++)
+		pack_repo(&w, &list->repos[i]);
+	if (rc_size < 0 || repo_cache_commit(&w, filename.buf, rc_size))
+		unlink(filename.buf);
+	repo_cache_writer_release(&w);
+	strbuf_release(&filename);
+}
+
+static int readme_is_default(const struct repo_cache *cache,
+			     const struct repo_cache_record *rec)
+{
+	const char *str = repo_cache_string(cache, rec->readme);
+	int i;
+
+	if (rec->nreadme != ctx.cfg.readme.nr)
+		return 0;
+	for (i = 0; i < ctx.cfg.readme.nr; i++, str += strlen(str) + 1)
+		if (ctx.cfg.readme.items[i].util ||
+		    strcmp(str, ctx.cfg.readme.items[i].string))
+			return 0;
+	return 1;
+}
+
+/* Add the repositories from the binary cached repolist. This is what parsing
+ * the text version through config_cb() does, but the strings are used in
+ * place instead of being looked up by name and copied. The readme list is
+ * the exception: choose_readme() frees its strings, so they are copied.
+ */
+static void add_cached_repos(struct repo_cache *cache)
+{
+	const struct repo_cache_record *rec;
+	struct cgit_repo *repo;
+	const char *name, *value;
+	int i, j, base, count;
+
+	base = cgit_repolist.count;
+	count = repo_cache_count(cache);
+	if (cgit_repolist.length < base + count) {
+		cgit_repolist.length = base + count;
+		cgit_repolist.repos = xrealloc(cgit_repolist.repos,
+					       cgit_repolist.length *
+					       sizeof(struct cgit_repo));
+	}
+	for (i = 0; i < count; i++) {
+		rec = repo_cache_record(cache, i);
+		repo = cgit_add_repo(repo_cache_string(cache, rec->url));
+		if (rec->name)
+			repo->name = repo_cache_string(cache, rec->name);
+		repo->path = repo_cache_string(cache, rec->path);
+		if (rec->owner)
+			repo->owner = repo_cache_string(cache, rec->owner);
+		if (rec->desc)
+			repo->desc = repo_cache_string(cache, rec->desc);
+		if (rec->nreadme && !readme_is_default(cache, rec)) {
+			memset(&repo->readme, 0, sizeof(repo->readme));
+			value = repo_cache_string(cache, rec->readme);
+			for (j = 0; value && j < rec->nreadme; j++) {
+				string_list_append(&repo->readme, xstrdup(value));
+				value += strlen(value) + 1;
+			}
+		}
+		if (rec->defbranch)
+			repo->defbranch = repo_cache_string(cache, rec->defbranch);
+		if (rec->module_link)
+			repo->module_link = repo_cache_string(cache, rec->module_link);
+		if (rec->section)
+			repo->section = repo_cache_string(cache, rec->section);
+		if (rec->clone_url)
+			repo->clone_url = repo_cache_string(cache, rec->clone_url);
+		if (rec->logo)
+			repo->logo = repo_cache_string(cache, rec->logo);
+		if (rec->logo_link)
+			repo->logo_link = repo_cache_string(cache, rec->logo_link);
+		repo->enable_commit_graph = rec->enable_commit_graph;
+		repo->enable_log_filecount = rec->enable_log_filecount;
+		repo->enable_log_linecount = rec->enable_log_linecount;
+		repo->enable_remote_branches = rec->enable_remote_branches;
+		repo->enable_subject_links = rec->enable_subject_links;
+		name = repo_cache_string(cache, rec->settings);
+		for (j = 0; name && j < rec->nsettings; j++) {
+			value = name + strlen(name) + 1;
+			repo_config(repo, name, value);
+			name = value + strlen(value) + 1;
+		}
+	}
+	cgit_repo_index_map(cache, base);
+}
+
+static void scan_repolist(const char *path)
+{
+	timing_begin(TIMING_SCAN);
+	if (ctx.cfg.project_list)
+		scan_projects(path, ctx.cfg.project_list, repo_config);
+	else
+		scan_tree(path, repo_config);
+	metrics_scan(timing_end(TIMING_SCAN));
+}
+
 /* Scan 'path' for git repositories, save the resulting repolist in 'cached_rc'
  * and return 0 on success.
  */
 static int generate_cached_repolist(const char *path, const char *cached_rc)
 {
 	struct strbuf locked_rc = STRBUF_INIT;
+	struct strbuf scan_index = STRBUF_INIT;
 	int result = 0;
 	int idx;
 	FILE *f;
@@ -824,48 +1325,69 @@ static int generate_cached_repolist(const char *path, const char *cached_rc)
 				locked_rc.buf, strerror(result), result);
 		goto out;
 	}
+	/* Only what changed since the last scan is read again. */
+	strbuf_addf(&scan_index, "%s.scan", cached_rc);
+	scan_tree_begin(scan_index.buf);
 	idx = cgit_repolist.count;
-	if (ctx.cfg.project_list)
-		scan_projects(path, ctx.cfg.project_list, repo_config);
-	else
-		scan_tree(path, repo_config);
+	scan_repolist(path);
+	scan_tree_end(scan_index.buf, print_repo);
+	/* Threaded scans find repositories in no particular order, sort them
+	 * so the cached repolist doesn't depend on scan-threads.
+	 */
+	qsort(cgit_repolist.repos + idx, cgit_repolist.count - idx,
+	      sizeof(struct cgit_repo), cmp_repos);
+	cgit_repo_index_reset();
 	print_repolist(f, &cgit_repolist, idx);
+	/* Written first, so the binary cache is never older than the text
+	 * one it is paired with.
+	 */
+	write_repo_cache(cached_rc, &cgit_repolist, idx, ftell(f));
 	if (rename(locked_rc.buf, cached_rc))
 		fprintf(stderr, "[cgit] Error renaming %s to %s: %s (%d)\n",
 			locked_rc.buf, cached_rc, strerror(errno), errno);
 	fclose(f);
 out:
 	strbuf_release(&locked_rc);
+	strbuf_release(&scan_index);
 	return result;
 }
 
-static void process_cached_repolist(const char *path)
+/* Add the repositories found below 'path' from the cached repolist, which is
+ * (re)generated as needed. Returns 0 on success; if no cached repolist could
+ * be generated nothing has been added and the caller has to scan manually.
+ */
+static int process_cached_repolist(const char *path)
 {
 	struct stat st;
 	struct strbuf cached_rc = STRBUF_INIT;
+	struct strbuf cached_bin = STRBUF_INIT;
+	struct repo_cache *cache;
 	time_t age;
 	unsigned long hash;
+	int result = 0;
 	hash = hash_str(path);
 	if (ctx.cfg.project_list)
 		hash += hash_str(ctx.cfg.project_list);
 	strbuf_addf(&cached_rc, "%s/rc-%8lx", ctx.cfg.cache_root, hash);
 
-	if (stat(cached_rc.buf, &st)) {
+	if (rescan_repolist || stat(cached_rc.buf, &st)) {
 		/* Nothing is cached, we need to scan without forking. And
-		 * if we fail to generate a cached repolist, we need to
-		 * invoke scan_tree manually.
+		 * if we fail to generate a cached repolist, the caller needs
+		 * to invoke scan_tree manually.
 		 */
-		if (generate_cached_repolist(path, cached_rc.buf)) {
-			if (ctx.cfg.project_list)
-				scan_projects(path, ctx.cfg.project_list,
-					      repo_config);
-			else
-				scan_tree(path, repo_config);
-		}
-		goto out;
+		result = generate_cached_repolist(path, cached_rc.buf);
+		/* A reload racing with a regeneration can use its result. */
+		if (!result || !rescan_repolist || stat(cached_rc.buf, &st))
+			goto out;
+		result = 0;
 	}
 
-	parse_configfile(cached_rc.buf, config_cb);
+	strbuf_addf(&cached_bin, "%s.bin", cached_rc.buf);
+	cache = repo_cache_open(cached_bin.buf, st.st_size);
+	if (cache)
+		add_cached_repos(cache);
+	else
+		parse_configfile(cached_rc.buf, config_cb);
 
 	/* If the cached configfile hasn't expired, lets exit now */
 	age = time(NULL) - st.st_mtime;
@@ -882,6 +1404,8 @@ static void process_cached_repolist(const char *path)
 	exit(generate_cached_repolist(path, cached_rc.buf));
 out:
 	strbuf_release(&cached_rc);
+	strbuf_release(&cached_bin);
+	return result;
 }
 
 static void cgit_parse_args(int argc, const char **argv)
@@ -899,6 +1423,26 @@ static void cgit_parse_args(int argc, const char **argv)
 		if (!strcmp(argv[i], "--nohttp")) {
 			ctx.env.no_http = "1";
 		}
+		if (!strncmp(argv[i], "--scgi=", 7)) {
+			ctx.cfg.scgi_socket = xstrdup(argv[i] + 7);
+		}
+		if (!strncmp(argv[i], "--scgi-workers=", 15)) {
+			ctx.cfg.scgi_workers = atoi(argv[i] + 15);
+			scgi_workers_arg = 1;
+		}
+		if (!strncmp(argv[i], "--scan-threads=", 15)) {
+			ctx.cfg.scan_threads = atoi(argv[i] + 15);
+			scan_threads_arg = 1;
+		}
+		if (!strcmp(argv[i], "--watch")) {
+			watch_mode = 1;
+		}
+		if (!strcmp(argv[i], "--metrics")) {
+			metrics_mode = 1;
+		}
+		if (!strncmp(argv[i], "--watch-pool=", 13)) {
+			watch_pidfile = xstrdup(argv[i] + 13);
+		}
 		if (!strncmp(argv[i], "--query=", 8)) {
 			ctx.qry.raw = xstrdup(argv[i] + 8);
 		}
@@ -943,11 +1487,25 @@ static void cgit_parse_args(int argc, const char **argv)
 	}
 }
 
+/* Whether the page is cached by the state of the repository's refs, see
+ * page_cache_key(). Pages about an object named by its id are left to
+ * cache-static-ttl.
+ */
+static int ref_keyed(void)
+{
+	if (!ctx.cfg.cache_ref_ttl || !ctx.repo || !ctx.page.etag)
+		return 0;
+	return !ctx.qry.has_sha1 || ctx.qry.has_symref;
+}
+
 static int calc_ttl()
 {
 	if (!ctx.repo)
 		return ctx.cfg.cache_root_ttl;
 
+	if (ref_keyed())
+		return ctx.cfg.cache_ref_ttl;
+
 	if (!ctx.qry.page)
 		return ctx.cfg.cache_repo_ttl;
 
@@ -960,18 +1518,221 @@ static int calc_ttl()
 	return ctx.cfg.cache_repo_ttl;
 }
 
-int main(int argc, const char **argv)
+/* The repository a request names, gathered the way process_cgi_request()
+ * will find it later: from url= or PATH_INFO if given, from r= otherwise.
+ */
+static struct {
+	char *repo;
+	char *url;
+} requested;
+
+static void requested_cb(const char *name, const char *value)
+{
+	if (!value)
+		value = "";
+	if (!strcmp(name, "r")) {
+		free(requested.repo);
+		requested.repo = xstrdup(value);
+	} else if (!strcmp(name, "url")) {
+		if (*value == '/')
+			value++;
+		free(requested.url);
+		requested.url = xstrdup(value);
+	}
+}
+
+/* Collect the urls parse_url() would try for the request, in its order. */
+static void requested_repo_urls(struct string_list *urls)
+{
+	const char *query = getenv("QUERY_STRING");
+	const char *path = getenv("PATH_INFO");
+	char *buf, *p;
+
+	memset(&requested, 0, sizeof(requested));
+	if (query)
+		http_parse_querystring(query, requested_cb);
+	if (!requested.url && path) {
+		if (path[0] == '/')
+			path++;
+		requested.url = xstrdup(path);
+	}
+	if (requested.url) {
+		if (requested.url[0]) {
+			string_list_append(urls, requested.url);
+			buf = xstrdup(requested.url);
+			for (p = strchr(buf, '/'); p; p = strchr(p + 1, '/')) {
+				*p = '\0';
+				string_list_append(urls, buf);
+				*p = '/';
+			}
+			free(buf);
+		}
+	} else if (requested.repo && requested.repo[0])
+		string_list_append(urls, requested.repo);
+	free(requested.repo);
+	free(requested.url);
+}
+
+/* Find the Gerrit project of the repository 'url' below scan-path 'path',
+ * either in the loaded repolist from 'start' on or, with a 'start' of -1,
+ * on disk. Returns 1 if there is one.
+ */
+static int gerrit_project_of(const char *url, const char *path, int start,
+			     struct strbuf *name)
+{
+	struct cgit_repo *repo;
+	struct strbuf dir = STRBUF_INIT;
+	struct stat st;
+	int found;
+
+	if (start >= 0) {
+		repo = cgit_lookup_repo(url);
+		if (!repo || repo - cgit_repolist.repos < start)
+			return 0;
+		url = repo->url;
+	}
+	strbuf_reset(name);
+	strbuf_addstr(name, url);
+	if (name->len > 4 && !strcmp(name->buf + name->len - 4, ".git"))
+		strbuf_setlen(name, name->len - 4);
+	if (start >= 0)
+		return 1;
+
+	/* Gerrit keeps project <name> in <name>.git, see gerrit_scan_projects(). */
+	if (!name->len || name->buf[0] == '/' || strstr(name->buf, ".."))
+		return 0;
+	strbuf_addf(&dir, "%s/%s.git", path, name->buf);
+	found = !stat(dir.buf, &st) && S_ISDIR(st.st_mode);
+	strbuf_release(&dir);
+	return found;
+}
+
+/* A page about one repository only needs to know whether that repository
+ * is visible, which Gerrit answers much faster than listing every project
+ * the user may see. The whole list is only fetched for the index and for
+ * urls which don't name a Gerrit project.
+ */
+static void fetch_gerrit_projects(const char *path, int start,
+				  struct gerrit_project_list *list)
+{
+	struct string_list urls = STRING_LIST_INIT_DUP;
+	struct string_list_item *item;
+	struct strbuf name = STRBUF_INIT;
+	int found = 0;
+
+	requested_repo_urls(&urls);
+	for_each_string_list_item(item, &urls) {
+		if (!gerrit_project_of(item->string, path, start, &name))
+			continue;
+		if (found)
+			gerrit_release_project_list(list);
+		found = 1;
+		/* A hidden prefix doesn't stop parse_url() from trying the
+		 * longer ones, so only a visible project ends the search.
+		 */
+		if (gerrit_fetch_project(&ctx, name.buf, list) ||
+		    list->projects.nr)
+			break;
+	}
+	if (!found)
+		gerrit_fetch_project_list(&ctx, list);
+	string_list_clear(&urls, 0);
+	strbuf_release(&name);
+}
+
+/* The page cache is keyed by url, which isn't enough when the repolist is
+ * the part of scan-path the user may see. A page about a repository is the
+ * same for everyone who sees that repository, and a user who doesn't never
+ * gets ctx.repo for it, so such pages are keyed by the url and the
+ * repository it resolved to. Every other page (the index, unknown urls)
+ * shows the visible repositories and is keyed by a digest of them, which
+ * users with the same access share.
+ *
+ * Repository urls hold no newline, so the part after the last one always
+ * tells the two kinds of key apart.
+ *
+ * With cache-ref-ttl, pages about a repository are keyed by its ETag as
+ * well, which changes with the refs, the repository's settings and cgitrc.
+ * Such a page stays valid until one of them does, and a moved branch gets
+ * a new key instead of waiting for the old page to expire.
+ */
+static char *page_cache_key(void)
+{
+	const char *raw = ctx.qry.raw ? ctx.qry.raw : "";
+	const char *refs = ref_keyed() ? ctx.page.etag : NULL;
+	unsigned char sha1[20];
+	git_SHA_CTX c;
+	int i;
+
+	if (!gerrit_acl && !refs)
+		return ctx.qry.raw;
+	if (!gerrit_acl)
+		return fmtalloc("%s\nrefs:%s", raw, refs);
+	if (ctx.repo && refs)
+		return fmtalloc("%s\nrepo:%s\nrefs:%s", raw, ctx.repo->url,
+				refs);
+	if (ctx.repo)
+		return fmtalloc("%s\nrepo:%s", raw, ctx.repo->url);
+	git_SHA1_Init(&c);
+	for (i = 0; i < cgit_repolist.count; i++)
+		git_SHA1_Update(&c, cgit_repolist.repos[i].url,
+				strlen(cgit_repolist.repos[i].url) + 1);
+	git_SHA1_Final(sha1, &c);
+	return fmtalloc("%s\nrepos:%s", raw, sha1_to_hex(sha1));
+}
+
+struct cache_request {
+	int size;
+	char *key;
+	int ttl;
+	int err;
+};
+
+static void cache_request(void *cbdata)
+{
+	struct cache_request *req = cbdata;
+
+	req->err = cache_process(req->size, ctx.cfg.cache_root, req->key,
+				 req->ttl, process_request, &ctx);
+}
+
+/* Whether the page is collected before it is sent, to give it a
+ * Content-Length. Snapshots are streamed while they are made, and HEAD
+ * requests exit right after the headers.
+ */
+static int buffer_output(void)
+{
+	if (!ctx.cfg.buffer_output)
+		return 0;
+	if (ctx.qry.page && !strcmp(ctx.qry.page, "snapshot"))
+		return 0;
+	return !ctx.env.request_method || strcmp(ctx.env.request_method, "HEAD");
+}
+
+/* p=metrics at the root, never cached and only for the clients listed in
+ * metrics-allow.
+ */
+static int print_metrics_page(void)
+{
+	ctx.page.mimetype = "text/plain; version=0.0.4";
+	if (!timing_client_allowed(ctx.cfg.metrics_allow)) {
+		ctx.page.status = 403;
+		ctx.page.statusmsg = "Forbidden";
+		cgit_print_http_headers(&ctx);
+		html("Forbidden\n");
+	} else {
+		cgit_print_http_headers(&ctx);
+		metrics_print();
+	}
+	metrics_request();
+	return 0;
+}
+
+static int process_cgi_request(void)
 {
 	const char *path;
 	int err, ttl;
 
-	prepare_context(&ctx);
-	cgit_repolist.length = 0;
-	cgit_repolist.count = 0;
-	cgit_repolist.repos = NULL;
-
-	cgit_parse_args(argc, argv);
-	parse_configfile(expand_macros(ctx.env.cgit_config), config_cb);
 	ctx.repo = NULL;
 	http_parse_querystring(ctx.qry.raw, querystring_cb);
 
@@ -999,20 +1760,481 @@ int main(int argc, const char **argv)
 			ctx.qry.raw = newqry;
 		} else
 			ctx.qry.raw = xstrdup(ctx.qry.url);
-		cgit_parse_url(ctx.qry.url);
+		parse_url(ctx.qry.url);
 	}
 
+	if (!ctx.repo && ctx.cfg.metrics && ctx.qry.page &&
+	    !strcmp(ctx.qry.page, "metrics"))
+		return print_metrics_page();
+
+	if (ctx.repo && (ctx.cfg.cache_ref_ttl || getenv("HTTP_IF_NONE_MATCH") ||
+			 getenv("HTTP_IF_MODIFIED_SINCE")))
+		set_validators(&ctx);
+
 	ttl = calc_ttl();
 	ctx.page.expires += ttl * 60;
+
+	/* Answer a conditional request before the page cache, which would
+	 * keep the 304 for everybody else.
+	 */
+	if (ctx.repo && (getenv("HTTP_IF_NONE_MATCH") ||
+			 getenv("HTTP_IF_MODIFIED_SINCE"))) {
+		if (not_modified(&ctx)) {
+			ctx.page.status = 304;
+			ctx.page.statusmsg = "Not Modified";
+			cgit_print_http_headers(&ctx);
+			timing_log();
+			metrics_request();
+			return 0;
+		}
+	}
 	if (ctx.env.request_method && !strcmp(ctx.env.request_method, "HEAD"))
 		ctx.cfg.nocache = 1;
 	if (ctx.cfg.nocache)
 		ctx.cfg.cache_size = 0;
-	err = cache_process(ctx.cfg.cache_size, ctx.cfg.cache_root,
-			    ctx.qry.raw, ttl, process_request, &ctx);
+	timing_begin(TIMING_CACHE);
+	if (ctx.cfg.cache_shards > 0 && ctx.cfg.cache_size > 0)
+		err = page_cache_process(ctx.cfg.cache_size, ctx.cfg.cache_root,
+					 page_cache_key(), ttl, process_request, &ctx);
+	else if (buffer_output()) {
+		struct cache_request req = {
+			ctx.cfg.cache_size, page_cache_key(), ttl, 0
+		};
+
+		err = page_buffer_process(ctx.cfg.cache_root, cache_request,
+					  &req);
+		if (!err)
+			err = req.err;
+	} else
+		err = page_slot_process(ctx.cfg.cache_size, ctx.cfg.cache_root,
+					page_cache_key(), ttl, process_request,
+					&ctx);
+	timing_end(TIMING_CACHE);
 	if (err)
 		cgit_print_error("Error processing page: %s (%d)",
 				 strerror(err), err);
+	timing_log();
+	metrics_request();
 	return err;
 }
 
+static volatile sig_atomic_t scgi_stop;
+static volatile sig_atomic_t scgi_reload;
+
+static void scgi_stop_handler(int sig)
+{
+	scgi_stop = 1;
+}
+
+static void scgi_reload_handler(int sig)
+{
+	scgi_reload = 1;
+}
+
+static void scgi_child_handler(int sig)
+{
+}
+
+/* Install 'handler' for the signals in 'set' and block them. They are only
+ * delivered while waiting in sigsuspend() or pselect() with 'orig', so a
+ * signal can't slip in between checking the flags and going to sleep.
+ */
+static void scgi_signals(sigset_t *set, void (*handler)(int), sigset_t *orig)
+{
+	struct sigaction sa;
+	int sig;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sigemptyset(&sa.sa_mask);
+	for (sig = 1; sig < NSIG; sig++)
+		if (sigismember(set, sig) == 1)
+			sigaction(sig, &sa, NULL);
+	sigprocmask(SIG_BLOCK, set, orig);
+}
+
+/* Undo the signal setup of the parent in a freshly forked child. */
+static void scgi_reset_signals(const sigset_t *orig)
+{
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	sigprocmask(SIG_SETMASK, orig, NULL);
+}
+
+/*
+ * A worker serves requests one at a time until it is told to stop or has
+ * served scgi-max-requests of them. The configuration and the repolist have
+ * already been loaded by the pool it was forked from.
+ *
+ * Each request is rendered in a child forked off the worker. That is what
+ * resets the per-request state: ctx.qry, ctx.page, ctx.repo, whatever
+ * querystring_cb() and the page allocate, and all of libgit's state for the
+ * repository (object and ref caches, GIT_DIR) only ever exist in the child.
+ * The worker itself only keeps the configuration, the repolist and its
+ * connection to Gerrit, which is why the project list is fetched here and
+ * only applied in the child. The page cache shards are mapped here too, so
+ * the children find pages without opening anything.
+ */
+static int scgi_worker(int listen_fd)
+{
+	struct gerrit_project_list list;
+	sigset_t set, orig;
+	fd_set fds;
+	int fd, served = 0;
+	pid_t pid;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	scgi_signals(&set, scgi_stop_handler, &orig);
+	signal(SIGHUP, SIG_IGN);
+	if (ctx.cfg.cache_shards > 0 && !ctx.cfg.nocache)
+		page_cache_open(ctx.cfg.cache_root, ctx.cfg.cache_size);
+
+	while (!scgi_stop && (!ctx.cfg.scgi_max_requests ||
+			      served < ctx.cfg.scgi_max_requests)) {
+		/* Reap background refreshes of the cached lists. */
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+		FD_ZERO(&fds);
+		FD_SET(listen_fd, &fds);
+		if (pselect(listen_fd + 1, &fds, NULL, NULL, NULL, &orig) <= 0)
+			continue;
+		/* Every worker in the pool is woken up, only one gets it. */
+		fd = scgi_accept(listen_fd);
+		if (fd < 0) {
+			if (errno != EINTR && errno != EPROTO &&
+			    errno != EAGAIN && errno != EWOULDBLOCK)
+				fprintf(stderr, "[cgit] Error accepting request: %s (%d)\n",
+					strerror(errno), errno);
+			continue;
+		}
+		served++;
+		timing_start();
+
+		memset(&list, 0, sizeof(list));
+		if (gerrit_scan.path)
+			fetch_gerrit_projects(gerrit_scan.path, gerrit_scan.start,
+					      &list);
+
+		pid = fork();
+		if (!pid) {
+			scgi_reset_signals(&orig);
+			close(listen_fd);
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			close(fd);
+			gerrit_curl_forget();
+			prepare_request(&ctx);
+			if (gerrit_scan.path) {
+				if (gerrit_scan.start >= 0)
+					gerrit_apply_project_list(&list, NULL, &ctx,
+								  gerrit_scan.start, NULL);
+				else
+					gerrit_apply_project_list(&list, gerrit_scan.path,
+								  &ctx, 0, repo_config);
+				ctx.repo = NULL;
+			}
+			exit(process_cgi_request());
+		}
+		close(fd);
+		if (pid < 0)
+			fprintf(stderr, "[cgit] Error forking request: %s (%d)\n",
+				strerror(errno), errno);
+		else
+			while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+				;
+		gerrit_release_project_list(&list);
+	}
+	gerrit_curl_cleanup();
+	return 0;
+}
+
+static pid_t scgi_spawn(int fd, int (*fn)(int), const sigset_t *orig)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (!pid) {
+		scgi_reset_signals(orig);
+		exit(fn(fd));
+	}
+	if (pid < 0)
+		fprintf(stderr, "[cgit] Error forking worker: %s (%d)\n",
+			strerror(errno), errno);
+	return pid;
+}
+
+/*
+ * A pool parses cgitrc and loads the repolist, then forks its workers. They
+ * all share the loaded repolist copy-on-write instead of each building a heap
+ * copy of their own, and workers retiring after scgi-max-requests are
+ * replaced from the same image. Once all workers are up a byte is written to
+ * 'ready_fd'. On SIGTERM the workers are stopped; a request in flight is
+ * finished first.
+ */
+static int scgi_pool(int listen_fd, int ready_fd)
+{
+	sigset_t set, orig;
+	pid_t *workers, pid;
+	time_t *started;
+	int i, n, status, crashed = 0;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGCHLD);
+	scgi_signals(&set, scgi_stop_handler, &orig);
+	signal(SIGCHLD, scgi_child_handler);
+	signal(SIGHUP, SIG_IGN);
+
+	parse_configfile(expand_macros(ctx.env.cgit_config), config_cb);
+	ctx.repo = NULL;
+	rescan_repolist = 0;
+	/* Once for all requests the workers serve, not in every one of them. */
+	scan_tree_load_all();
+
+	n = ctx.cfg.scgi_workers > 0 ? ctx.cfg.scgi_workers : 1;
+	workers = xcalloc(n, sizeof(*workers));
+	started = xcalloc(n, sizeof(*started));
+	while (!scgi_stop) {
+		/* Don't spin if workers die right after starting. */
+		if (crashed) {
+			sleep(1);
+			crashed = 0;
+		}
+		for (i = 0; i < n; i++) {
+			if (workers[i] > 0)
+				continue;
+			started[i] = time(NULL);
+			workers[i] = scgi_spawn(listen_fd, scgi_worker, &orig);
+			if (workers[i] < 0)
+				crashed = 1;
+		}
+		if (ready_fd >= 0) {
+			write_in_full(ready_fd, "", 1);
+			close(ready_fd);
+			ready_fd = -1;
+		}
+		/* Workers retiring cleanly are replaced right away, only
+		 * failing soon after starting looks like a crash loop.
+		 */
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			for (i = 0; i < n; i++)
+				if (workers[i] == pid) {
+					workers[i] = 0;
+					if ((!WIFEXITED(status) || WEXITSTATUS(status)) &&
+					    time(NULL) - started[i] < 1)
+						crashed = 1;
+				}
+		for (i = 0; i < n && workers[i] > 0; i++)
+			;
+		if (i == n && !scgi_stop)
+			sigsuspend(&orig);
+	}
+	for (i = 0; i < n; i++)
+		if (workers[i] > 0)
+			kill(workers[i], SIGTERM);
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	free(started);
+	free(workers);
+	return 0;
+}
+
+/* Fork a new pool and wait until it is serving. Returns -1 if it failed to
+ * start, so the pool it was meant to replace can be kept.
+ */
+static pid_t scgi_start_pool(int listen_fd, const sigset_t *orig)
+{
+	int ready[2];
+	pid_t pid;
+	char c;
+
+	if (pipe(ready)) {
+		fprintf(stderr, "[cgit] Error creating pipe: %s (%d)\n",
+			strerror(errno), errno);
+		return -1;
+	}
+	pid = fork();
+	if (!pid) {
+		close(ready[0]);
+		scgi_reset_signals(orig);
+		exit(scgi_pool(listen_fd, ready[1]));
+	}
+	close(ready[1]);
+	if (pid < 0)
+		fprintf(stderr, "[cgit] Error forking pool: %s (%d)\n",
+			strerror(errno), errno);
+	else if (xread(ready[0], &c, 1) != 1) {
+		fprintf(stderr, "[cgit] Worker pool failed to start\n");
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+			;
+		pid = -1;
+	}
+	close(ready[0]);
+	return pid;
+}
+
+/*
+ * Listen on 'path' and keep a pool of scgi-workers workers serving it.
+ *
+ * On SIGHUP the cached repolist is regenerated by a new pool, which takes
+ * over once its workers are accepting. Only then is the old pool stopped;
+ * the listening socket stays open throughout, so no request is dropped.
+ */
+static int scgi_master(const char *path)
+{
+	sigset_t set, orig;
+	pid_t pool, next, pid;
+	int fd;
+
+	fd = scgi_listen(path);
+	if (fd < 0) {
+		fprintf(stderr, "[cgit] Error listening on %s: %s (%d)\n",
+			path, strerror(errno), errno);
+		return errno;
+	}
+	gerrit_deferred = 1;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGHUP);
+	scgi_signals(&set, scgi_stop_handler, &orig);
+	signal(SIGCHLD, scgi_child_handler);
+	signal(SIGHUP, scgi_reload_handler);
+
+	pool = -1;
+	while (!scgi_stop) {
+		if (pool < 0) {
+			pool = scgi_start_pool(fd, &orig);
+			if (pool < 0) {
+				sleep(1);
+				continue;
+			}
+		}
+		if (scgi_reload) {
+			scgi_reload = 0;
+			rescan_repolist = 1;
+			next = scgi_start_pool(fd, &orig);
+			rescan_repolist = 0;
+			if (next > 0) {
+				kill(pool, SIGTERM);
+				pool = next;
+			}
+			continue;
+		}
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+			if (pid == pool)
+				pool = -1;
+		if (pool > 0 && !scgi_reload && !scgi_stop)
+			sigsuspend(&orig);
+	}
+	if (pool > 0)
+		kill(pool, SIGTERM);
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	close(fd);
+	unlink(path);
+	return 0;
+}
+
+static int cgit_argc;
+static const char **cgit_argv;
+
+/* Ask the SCGI master in 'pidfile' to load a new pool, which regenerates the
+ * cached repolists as well. Returns 0 if it was signalled.
+ */
+static int reload_pool(const char *pidfile)
+{
+	struct strbuf buf = STRBUF_INIT;
+	pid_t pid = 0;
+	int fd;
+
+	fd = open(pidfile, O_RDONLY);
+	if (fd >= 0) {
+		if (strbuf_read(&buf, fd, 16) > 0)
+			pid = atoi(buf.buf);
+		close(fd);
+	}
+	strbuf_release(&buf);
+	if (pid <= 0 || kill(pid, SIGHUP))
+		return -1;
+	return 0;
+}
+
+/* Called by the watcher once projects were added, removed or renamed. */
+static void repolist_changed(void)
+{
+	pid_t pid;
+
+	if (watch_pidfile && !reload_pool(watch_pidfile))
+		return;
+	/* Parse cgitrc from scratch like a request would, just without
+	 * applying the Gerrit ACL, and rewrite every cached repolist.
+	 */
+	pid = fork();
+	if (!pid) {
+		prepare_context(&ctx);
+		cgit_repolist.count = 0;
+		cgit_parse_args(cgit_argc, cgit_argv);
+		watch_mode = 0;
+		gerrit_deferred = 1;
+		rescan_repolist = 1;
+		parse_configfile(expand_macros(ctx.env.cgit_config), config_cb);
+		exit(0);
+	}
+	if (pid < 0)
+		fprintf(stderr, "[cgit] Error forking scan: %s (%d)\n",
+			strerror(errno), errno);
+	else
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+			;
+}
+
+/*
+ * Keep the cached repolists up to date while projects are created, deleted
+ * or renamed below any scan-path, so requests never have to wait for a scan
+ * even with a long cache-scanrc-ttl.
+ */
+static int watch_scan_paths(void)
+{
+	parse_configfile(expand_macros(ctx.env.cgit_config), config_cb);
+	if (!watch_paths.nr) {
+		fprintf(stderr, "[cgit] No scan-path to watch\n");
+		return 1;
+	}
+	if (ctx.cfg.nocache)
+		fprintf(stderr, "[cgit] Warning: nocache is set, repolists are not cached\n");
+	return scan_tree_watch(&watch_paths, ctx.cfg.scan_watch_delay,
+			       repolist_changed);
+}
+
+int main(int argc, const char **argv)
+{
+	prepare_context(&ctx);
+	cgit_repolist.length = 0;
+	cgit_repolist.count = 0;
+	cgit_repolist.repos = NULL;
+
+	cgit_argc = argc;
+	cgit_argv = argv;
+	cgit_parse_args(argc, argv);
+	if (watch_mode)
+		return watch_scan_paths();
+	if (ctx.cfg.scgi_socket)
+		return scgi_master(ctx.cfg.scgi_socket);
+	if (metrics_mode) {
+		parse_configfile(expand_macros(ctx.env.cgit_config), config_cb);
+		return metrics_print();
+	}
+	timing_start();
+	timing_begin(TIMING_CONFIG);
+	parse_configfile(expand_macros(ctx.env.cgit_config), config_cb);
+	timing_end(TIMING_CONFIG);
+	return process_cgi_request();
+}
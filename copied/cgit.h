@@ -92,6 +92,7 @@ struct cgit_repo {
 	struct cgit_filter *commit_filter;
 	struct cgit_filter *source_filter;
 	struct string_list submodules;
+	struct repo_meta *meta;	/* settings not read yet, see scan_tree_load() */
 };
 
 typedef void (*repo_config_fn)(struct cgit_repo *repo, const char *name,
@@ -197,8 +198,11 @@ struct cgit_config {
 	char *script_name;
 	char *section;
 	char *repository_sort;
+	char *scgi_socket;
 	char *virtual_root;	/* Always ends with '/'. */
 	char *strict_export;
+	char *server_timing_allow;
+	char *metrics_allow;
 	int cache_size;
 	int cache_dynamic_ttl;
 	int cache_max_create_time;
@@ -206,6 +210,23 @@ struct cgit_config {
 	int cache_root_ttl;
 	int cache_scanrc_ttl;
 	int cache_static_ttl;
+	/* CHERRY */
+	int gerrit_project_list_ttl;
+	int gerrit_connect_timeout;
+	int gerrit_timeout;
+	int gerrit_breaker_failures;
+	int gerrit_breaker_cooldown;
+	/* //CHERRY */
+	int scgi_max_requests;
+	int scgi_workers;
+	int scan_watch_delay;
+	int scan_threads;
+	int cache_shards;
+	int cache_shard_size;
+	int cache_ref_ttl;
+	int buffer_output;
+	int server_timing;
+	int metrics;
 	int case_sensitive_sort;
 	int embedded;
 	int enable_filter_overrides;
@@ -39,14 +39,31 @@ ifdef NO_C99_FORMAT
 	CFLAGS += -DNO_C99_FORMAT
 endif
 
+ifdef NO_INOTIFY
+	CFLAGS += -DNO_INOTIFY
+endif
+
+ifdef USE_IO_URING
+	CFLAGS += -DUSE_IO_URING
+	EXTRA_LIBS += -luring
+endif
+
 CGIT_OBJ_NAMES += cgit.o
 CGIT_OBJ_NAMES += cache.o
 CGIT_OBJ_NAMES += cmd.o
 CGIT_OBJ_NAMES += configfile.o
 CGIT_OBJ_NAMES += html.o
+CGIT_OBJ_NAMES += metrics.o
+CGIT_OBJ_NAMES += page-cache.o
 CGIT_OBJ_NAMES += parsing.o
+CGIT_OBJ_NAMES += repo-index.o
+CGIT_OBJ_NAMES += repo-cache.o
+CGIT_OBJ_NAMES += repo-probe.o
+CGIT_OBJ_NAMES += repo-state.o
 CGIT_OBJ_NAMES += scan-tree.o
+CGIT_OBJ_NAMES += scgi.o
 CGIT_OBJ_NAMES += shared.o
+CGIT_OBJ_NAMES += timing.o
 CGIT_OBJ_NAMES += ui-atom.o
 CGIT_OBJ_NAMES += ui-blob.o
 CGIT_OBJ_NAMES += ui-clone.o
@@ -70,6 +87,9 @@ CGIT_OBJ_NAMES += gerrit_curl.o
 
 CGIT_OBJS := $(addprefix $(CGIT_PREFIX),$(CGIT_OBJ_NAMES))
 
+# The lookup benchmark only needs the repo index and what it builds on.
+BENCH_LOOKUP_OBJS := $(addprefix $(CGIT_PREFIX),bench-lookup.o cache.o repo-cache.o repo-index.o)
+
 # Only cgit.c reference CGIT_VERSION so we only rebuild its objects when the
 # version changes.
 CGIT_VERSION_OBJS := $(addprefix $(CGIT_PREFIX),cgit.o)
@@ -100,7 +120,7 @@ $(CGIT_PREFIX)CGIT-CFLAGS: FORCE
 		echo "$$FLAGS" >$(CGIT_PREFIX)CGIT-CFLAGS; \
             fi
 
-$(CGIT_OBJS): %.o: %.c GIT-CFLAGS $(CGIT_PREFIX)CGIT-CFLAGS $(missing_dep_dirs)
+$(sort $(CGIT_OBJS) $(BENCH_LOOKUP_OBJS)): %.o: %.c GIT-CFLAGS $(CGIT_PREFIX)CGIT-CFLAGS $(missing_dep_dirs)
 	#$(QUIET_CC)$(CC) -o $*.o -c $(dep_args) $(MY_CFLAGS) $(ALL_CFLAGS) $(LOCAL_INCS) $(EXTRA_CPPFLAGS) $(CGIT_CFLAGS) $<
 	$(CC) -o $*.o -c $(dep_args) $(MY_CFLAGS) $(ALL_CFLAGS) $(LOCAL_INCS) $(EXTRA_CPPFLAGS) $(CGIT_CFLAGS) $<
 
@@ -109,3 +129,6 @@ $(CGIT_PREFIX)cgit: $(CGIT_OBJS) GIT-LDFLAGS $(GITLIBS)
 #$(CC) $(ALL_CFLAGS) $(LDIR) $(LOCAL_LDIR) $(ALL_LDFLAGS) $(filter %.o,$^) $(LIBS) $(LOCAL_LIBS) -o $@
 #CHERRY
 	$(CC) $(ALL_CFLAGS) $(MY_CFLAGS) $(LOCAL_INCS) $(LOCAL_LDIR) $(LDIR) $(ALL_LDFLAGS) $(filter %.o,$^) $(LIBS) $(EXTRA_LIBS) -o $@ 
+
+$(CGIT_PREFIX)bench-lookup: $(BENCH_LOOKUP_OBJS) GIT-LDFLAGS $(GITLIBS)
+	$(CC) $(ALL_CFLAGS) $(MY_CFLAGS) $(LDIR) $(ALL_LDFLAGS) $(filter %.o,$^) $(LIBS) -o $@
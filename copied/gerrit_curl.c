@@ -8,14 +8,23 @@
 
 #include "scan-tree.h"
 #include "cgit.h"
+#include "html.h"
 #include "gerrit_curl.h"
+#include "metrics.h"
+#include "timing.h"
 
 size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
 {
   size_t realsize = size * nmemb;
   MemoryStruct *mem = (MemoryStruct *)userp;
 
-  mem->memory = (char *)realloc(mem->memory, mem->size + realsize + 1);
+  if (mem->size + realsize + 1 > mem->alloc) {
+    /* Grow geometrically, not by one chunk at a time. */
+    mem->alloc = alloc_nr(mem->alloc);
+    if (mem->alloc < mem->size + realsize + 1)
+      mem->alloc = mem->size + realsize + 1;
+    mem->memory = (char *)realloc(mem->memory, mem->alloc);
+  }
   if(mem->memory == NULL) {
     /* out of memory! */
     fprintf(stderr, "not enough memory (realloc returned NULL)\n");
@@ -33,7 +42,13 @@ size_t WriteMemoryCallback2(void *contents, size_t size, size_t nmemb, void *use
   size_t realsize = size * nmemb;
   MemoryStruct *mem = (MemoryStruct *)userp;
 
-  mem->memory = (char *)realloc(mem->memory, mem->size + realsize + 1);
+  if (mem->size + realsize + 1 > mem->alloc) {
+    /* Grow geometrically, not by one chunk at a time. */
+    mem->alloc = alloc_nr(mem->alloc);
+    if (mem->alloc < mem->size + realsize + 1)
+      mem->alloc = mem->size + realsize + 1;
+    mem->memory = (char *)realloc(mem->memory, mem->alloc);
+  }
   if(mem->memory == NULL) {
     /* out of memory! */
     fprintf(stderr, "not enough memory (realloc returned NULL)\n");
@@ -47,41 +62,474 @@ size_t WriteMemoryCallback2(void *contents, size_t size, size_t nmemb, void *use
   return realsize;
 }
 
-int get_list(struct cgit_context *ctx,char *remote_user,  MemoryStruct *chunk) {
+enum {
+	PARSE_PREFIX,		/* before the object, e.g. Gerrit's ")]}'" line */
+	PARSE_VALUE,
+	PARSE_STRING,
+	PARSE_STRING_ESCAPE,
+	PARSE_KEY,
+	PARSE_KEY_ESCAPE,
+	PARSE_KEY_HEX,
+	PARSE_DONE,
+	PARSE_ERROR
+};
+
+static void gerrit_list_parser_init(struct gerrit_list_parser *p,
+				    struct string_list *projects)
+{
+	memset(p, 0, sizeof(*p));
+	p->projects = projects;
+	strbuf_init(&p->key, 0);
+	strbuf_init(&p->head, 0);
+	p->state = PARSE_PREFIX;
+}
+
+static void add_utf8(struct strbuf *sb, unsigned int c)
+{
+	if (c < 0x80)
+		strbuf_addch(sb, c);
+	else if (c < 0x800) {
+		strbuf_addch(sb, 0xc0 | (c >> 6));
+		strbuf_addch(sb, 0x80 | (c & 0x3f));
+	} else if (c < 0x10000) {
+		strbuf_addch(sb, 0xe0 | (c >> 12));
+		strbuf_addch(sb, 0x80 | ((c >> 6) & 0x3f));
+		strbuf_addch(sb, 0x80 | (c & 0x3f));
+	} else {
+		strbuf_addch(sb, 0xf0 | (c >> 18));
+		strbuf_addch(sb, 0x80 | ((c >> 12) & 0x3f));
+		strbuf_addch(sb, 0x80 | ((c >> 6) & 0x3f));
+		strbuf_addch(sb, 0x80 | (c & 0x3f));
+	}
+}
+
+/* A high surrogate that wasn't followed by its low half becomes U+FFFD. */
+static void flush_surrogate(struct gerrit_list_parser *p)
+{
+	if (!p->surrogate)
+		return;
+	add_utf8(&p->key, 0xfffd);
+	p->surrogate = 0;
+}
+
+static void parse_key_hex(struct gerrit_list_parser *p, char c)
+{
+	unsigned int u;
+
+	if (!isxdigit(c)) {
+		p->state = PARSE_ERROR;
+		return;
+	}
+	p->hex = p->hex * 16 + (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+	if (++p->hex_digits < 4)
+		return;
+	u = p->hex;
+	p->state = PARSE_KEY;
+	if (u >= 0xd800 && u < 0xdc00) {
+		/* The low half follows as another \u escape. */
+		flush_surrogate(p);
+		p->surrogate = u;
+		return;
+	}
+	if (u >= 0xdc00 && u < 0xe000) {
+		if (p->surrogate)
+			u = 0x10000 + ((p->surrogate - 0xd800) << 10) + (u - 0xdc00);
+		else
+			u = 0xfffd;
+		p->surrogate = 0;
+	} else
+		flush_surrogate(p);
+	add_utf8(&p->key, u);
+}
+
+/* Only the keys of the outermost object are decoded, everything else is
+ * merely skipped while keeping track of strings and nesting.
+ */
+static void gerrit_list_parser_feed(struct gerrit_list_parser *p,
+				    const char *buf, size_t len)
+{
+	const char *end = buf + len;
+	char c;
+
+	if (p->head.len < 32)
+		strbuf_add(&p->head, buf, len < 32 - p->head.len ? len : 32 - p->head.len);
+
+	for (; buf < end; buf++) {
+		c = *buf;
+		switch (p->state) {
+		case PARSE_PREFIX:
+			if (c == '{') {
+				p->depth = 1;
+				p->want_key = 1;
+				p->state = PARSE_VALUE;
+			}
+			break;
+		case PARSE_VALUE:
+			if (c == '"') {
+				if (p->depth == 1 && p->want_key) {
+					strbuf_reset(&p->key);
+					p->state = PARSE_KEY;
+				} else
+					p->state = PARSE_STRING;
+			} else if (c == '{' || c == '[')
+				p->depth++;
+			else if (c == '}' || c == ']') {
+				if (!--p->depth)
+					p->state = PARSE_DONE;
+			} else if (c == ',' && p->depth == 1)
+				p->want_key = 1;
+			break;
+		case PARSE_STRING:
+			if (c == '\\')
+				p->state = PARSE_STRING_ESCAPE;
+			else if (c == '"')
+				p->state = PARSE_VALUE;
+			break;
+		case PARSE_STRING_ESCAPE:
+			p->state = PARSE_STRING;
+			break;
+		case PARSE_KEY:
+			if (c == '\\') {
+				p->state = PARSE_KEY_ESCAPE;
+				break;
+			}
+			flush_surrogate(p);
+			if (c == '"') {
+				string_list_append(p->projects, p->key.buf);
+				p->want_key = 0;
+				p->state = PARSE_VALUE;
+			} else
+				strbuf_addch(&p->key, c);
+			break;
+		case PARSE_KEY_ESCAPE:
+			p->state = PARSE_KEY;
+			if (c != 'u')
+				flush_surrogate(p);
+			switch (c) {
+			case 'b': strbuf_addch(&p->key, '\b'); break;
+			case 'f': strbuf_addch(&p->key, '\f'); break;
+			case 'n': strbuf_addch(&p->key, '\n'); break;
+			case 'r': strbuf_addch(&p->key, '\r'); break;
+			case 't': strbuf_addch(&p->key, '\t'); break;
+			case 'u':
+				p->hex = 0;
+				p->hex_digits = 0;
+				p->state = PARSE_KEY_HEX;
+				break;
+			default:
+				strbuf_addch(&p->key, c);
+			}
+			break;
+		case PARSE_KEY_HEX:
+			parse_key_hex(p, c);
+			break;
+		case PARSE_DONE:
+		case PARSE_ERROR:
+			return;
+		}
+	}
+}
+
+/* Returns 0 if a complete object was read. */
+static int gerrit_list_parser_finish(struct gerrit_list_parser *p)
+{
+	int result = p->state == PARSE_DONE ? 0 : -1;
+
+	strbuf_release(&p->key);
+	strbuf_release(&p->head);
+	return result;
+}
+
+static size_t WriteProjectListCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	gerrit_list_parser_feed((struct gerrit_list_parser *)userp, contents, size * nmemb);
+	return size * nmemb;
+}
+
+/* One easy handle and one share object live as long as the process, so a
+ * persistent cgit keeps its connection, DNS and TLS session caches for
+ * Gerrit across requests instead of paying connection setup every time.
+ */
+static CURL *gerrit_curl;
+static CURLSH *gerrit_share;
+
+static CURL *gerrit_handle(void)
+{
+	if (!gerrit_curl) {
+		curl_global_init(CURL_GLOBAL_DEFAULT);
+		gerrit_share = curl_share_init();
+		curl_share_setopt(gerrit_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(gerrit_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+		curl_share_setopt(gerrit_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+		gerrit_curl = curl_easy_init();
+	} else
+		curl_easy_reset(gerrit_curl);
+	curl_easy_setopt(gerrit_curl, CURLOPT_SHARE, gerrit_share);
+	return gerrit_curl;
+}
+
+/* A forked child must not touch the connections of its parent; it simply
+ * starts over with handles of its own.
+ */
+void gerrit_curl_forget(void)
+{
+	gerrit_curl = NULL;
+	gerrit_share = NULL;
+}
+
+/* A circuit breaker shared by all cgit processes through a small file in
+ * cache-root. After gerrit-breaker-failures failed calls in a row Gerrit is
+ * left alone for gerrit-breaker-cooldown seconds, so that a Gerrit which is
+ * restarting doesn't keep every request waiting for the timeouts. The first
+ * call after the cool-down is a probe, made by one process while the others
+ * still find the breaker open: if it fails as well the breaker opens again
+ * right away.
+ */
+struct gerrit_breaker {
+	int failures;
+	time_t open_until;
+};
+
+/* Failures in the breaker file when it was last read, -1 if unknown. */
+static int breaker_failures = -1;
+
+static void breaker_path(struct cgit_context *ctx, struct strbuf *path)
+{
+	strbuf_addf(path, "%s/gerrit-breaker", ctx->cfg.cache_root);
+}
+
+static void read_breaker(int fd, struct gerrit_breaker *b)
+{
+	char buf[64];
+	long long until;
+	ssize_t n;
+
+	memset(b, 0, sizeof(*b));
+	n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return;
+	buf[n] = '\0';
+	if (sscanf(buf, "%d %lld", &b->failures, &until) != 2) {
+		b->failures = 0;
+		return;
+	}
+	b->open_until = until;
+}
+
+static void write_breaker(int fd, const struct gerrit_breaker *b,
+			  const char *path)
+{
+	char buf[64];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%d %lld\n", b->failures,
+		       (long long)b->open_until);
+	if (pwrite(fd, buf, len, 0) != len || ftruncate(fd, len))
+		fprintf(stderr, "[cgit] Error writing %s: %s (%d)\n",
+			path, strerror(errno), errno);
+}
+
+/* The cool-down is over: only the process getting here first under the
+ * lock probes Gerrit, the breaker stays open for the others for as long as
+ * the probe may take. Returns 1 if another process is probing already.
+ */
+static int breaker_probe(struct cgit_context *ctx, const char *path)
+{
+	struct gerrit_breaker b;
+	time_t now;
+	int fd, probing = 0;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return 0;
+	if (flock(fd, LOCK_EX)) {
+		fprintf(stderr, "[cgit] Error locking %s: %s (%d)\n",
+			path, strerror(errno), errno);
+		close(fd);
+		return 0;
+	}
+	read_breaker(fd, &b);
+	now = time(NULL);
+	if (b.open_until > now)
+		probing = 1;
+	else if (b.open_until) {
+		b.open_until = now + (ctx->cfg.gerrit_timeout > 0 ?
+				      ctx->cfg.gerrit_timeout : 60);
+		write_breaker(fd, &b, path);
+	}
+	close(fd);
+	return probing;
+}
+
+static int breaker_open(struct cgit_context *ctx)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct gerrit_breaker b;
+	int fd, result = 0;
+
+	if (ctx->cfg.gerrit_breaker_failures <= 0)
+		return 0;
+	breaker_path(ctx, &path);
+	fd = open(path.buf, O_RDONLY);
+	if (fd < 0) {
+		breaker_failures = 0;
+		goto out;
+	}
+	read_breaker(fd, &b);
+	close(fd);
+	breaker_failures = b.failures;
+	if (b.open_until > time(NULL))
+		result = 1;
+	else if (b.open_until)
+		result = breaker_probe(ctx, path.buf);
+out:
+	strbuf_release(&path);
+	return result;
+}
+
+static void breaker_update(struct cgit_context *ctx, int failed)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct gerrit_breaker b;
+	time_t now;
+	int fd;
+
+	if (ctx->cfg.gerrit_breaker_failures <= 0)
+		return;
+	/* The usual case: Gerrit answers and nothing failed before. */
+	if (!failed && !breaker_failures)
+		return;
+
+	breaker_path(ctx, &path);
+	fd = open(path.buf, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "[cgit] Error opening %s: %s (%d)\n",
+			path.buf, strerror(errno), errno);
+		goto out;
+	}
+	if (flock(fd, LOCK_EX)) {
+		fprintf(stderr, "[cgit] Error locking %s: %s (%d)\n",
+			path.buf, strerror(errno), errno);
+		close(fd);
+		goto out;
+	}
+	read_breaker(fd, &b);
+	now = time(NULL);
+	if (failed) {
+		b.failures++;
+		if (b.failures >= ctx->cfg.gerrit_breaker_failures) {
+			if (b.open_until <= now)
+				fprintf(stderr, "[cgit] Gerrit failed %d times in a row, "
+					"not calling it for %d seconds\n",
+					b.failures, ctx->cfg.gerrit_breaker_cooldown);
+			b.open_until = now + ctx->cfg.gerrit_breaker_cooldown;
+		}
+	} else {
+		b.failures = 0;
+		b.open_until = 0;
+	}
+	breaker_failures = b.failures;
+	write_breaker(fd, &b, path.buf);
+	close(fd);
+out:
+	strbuf_release(&path);
+}
+
+/* Every call to Gerrit goes through here: a hung Gerrit must not hold up
+ * the request longer than gerrit-timeout, and an open breaker means no
+ * call at all.
+ */
+static CURLcode gerrit_perform(struct cgit_context *ctx, CURL *curl)
+{
+	CURLcode res;
+	long connects = 0, code = 0;
+	uint64_t ns;
+
+	if (breaker_open(ctx))
+		return CURLE_COULDNT_CONNECT;
+	if (ctx->cfg.gerrit_connect_timeout > 0)
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT,
+				 (long)ctx->cfg.gerrit_connect_timeout);
+	if (ctx->cfg.gerrit_timeout > 0)
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)ctx->cfg.gerrit_timeout);
+
+	timing_begin(TIMING_GERRIT);
+	res = curl_easy_perform(curl);
+	ns = timing_end(TIMING_GERRIT);
+	/* Connection reuse is published with the metrics. */
+	if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) != CURLE_OK)
+		connects = -1;
+	if (res == CURLE_OK)
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+	breaker_update(ctx, res != CURLE_OK || code >= 500);
+	metrics_gerrit(ns, connects, res != CURLE_OK || code >= 500);
+#ifdef MYDEBUG
+	fprintf(stderr, "DEBUG gerrit connects:%ld\n", connects);
+#endif
+	return res;
+}
+
+void gerrit_curl_cleanup(void)
+{
+	if (gerrit_curl)
+		curl_easy_cleanup(gerrit_curl);
+	if (gerrit_share)
+		curl_share_cleanup(gerrit_share);
+	gerrit_curl_forget();
+}
+
+/* Fetch the names of the projects visible to 'remote_user' into 'projects'.
+ * Returns 0 on success, 1 if Gerrit wants the user to log in, -1 otherwise.
+ */
+int get_list(struct cgit_context *ctx, char *remote_user, struct string_list *projects) {
 	CURLcode res;
 	CURL *curl;
-	curl = curl_easy_init();
+	curl = gerrit_handle();
 	struct curl_slist * headers = NULL;
+	struct gerrit_list_parser parser;
 	int ret = 0;
+	gerrit_list_parser_init(&parser, projects);
 	headers = curl_slist_append(headers, remote_user);
 	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 	curl_easy_setopt(curl, CURLOPT_URL, ctx->cfg.gerrit_project_list_url);
 	//curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 	curl_easy_setopt(curl, CURLOPT_COOKIE,getenv("HTTP_COOKIE") );
 	curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)chunk);
-	res = curl_easy_perform(curl);
+#if LIBCURL_VERSION_NUM >= 0x071506
+	/* The list of a big site compresses very well. */
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+#endif
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteProjectListCallback);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&parser);
+	res = gerrit_perform(ctx, curl);
+	curl_slist_free_all(headers);
 	if(res != CURLE_OK) {
-		fprintf(stderr, "error: get_login curl_easy_perform() failed: %s url: %s\n", curl_easy_strerror(res), ctx->cfg.gerrit_project_list_url);
+		fprintf(stderr, "error: get_list curl_easy_perform() failed: %s url: %s\n", curl_easy_strerror(res), ctx->cfg.gerrit_project_list_url);
 		ret = -1;
 	}
 	else {
 #ifdef MYDEBUG
-		fprintf(stderr, "DEBUG curl_easy_perform data:%s\n", chunk->memory);
+		fprintf(stderr, "DEBUG curl_easy_perform projects:%d\n", (int)projects->nr);
 #endif
-		if( strcmp(chunk->memory, "Unauthorized") == 0) {
+		if( strcmp(parser.head.buf, "Unauthorized") == 0) {
 			ret = 1;
 		}
 	}
-    curl_easy_cleanup(curl);
+	if (gerrit_list_parser_finish(&parser) && ret == 0) {
+		fprintf(stderr,"error: failed to get json string\n");
+		ret = -1;
+	}
+	if (ret)
+		string_list_clear(projects, 0);
 	return ret;	
 }
 
 int get_login(struct cgit_context *ctx, char *remote_user, MemoryStruct *chunk) {
 	CURLcode res;
 	CURL *curl;
-	curl = curl_easy_init();
+	curl = gerrit_handle();
 	struct curl_slist * headers=NULL;
 	headers = curl_slist_append(headers, remote_user);
 	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
@@ -89,11 +537,16 @@ int get_login(struct cgit_context *ctx, char *remote_user, MemoryStruct *chunk)
 	//curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 	curl_easy_setopt(curl, CURLOPT_COOKIE,getenv("HTTP_COOKIE") );
 	curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-	curl_easy_setopt(curl, CURLOPT_COOKIEFILE, "");
+	/* No cookie engine (CURLOPT_COOKIEFILE): the Set-Cookie lines are
+	 * read from the headers below, and a jar on the shared handle would
+	 * survive curl_easy_reset() and send this user's session along with
+	 * the next user's calls.
+	 */
 	//curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, WriteMemoryCallback2);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, WriteMemoryCallback);
 	curl_easy_setopt(curl, CURLOPT_WRITEHEADER, (void *)chunk);
-	res = curl_easy_perform(curl);
+	res = gerrit_perform(ctx, curl);
+	curl_slist_free_all(headers);
 #if MYDEBUG
 	fprintf(stderr,"DEBUG: login response head ----> \n%s\n",chunk->memory);
 	fprintf(stderr,"DEBUG: <-- login response head \n"); 
@@ -129,16 +582,241 @@ int get_login(struct cgit_context *ctx, char *remote_user, MemoryStruct *chunk)
 			ret = -1;
 		}
 	}
-    curl_easy_cleanup(curl);
 
 	return ret;
 }
-int gerrit_get_project_list(char *value, struct cgit_context *ctx, repo_config_fn repo_config) {
-#ifdef MYDEBUG
-  fprintf(stderr, "DEBUG gerrit_get_project_list start\n");
-  fprintf(stderr,"DEBUG: REQUEST_URI:%s\n", getenv("REQUEST_URI"));
-  fprintf(stderr, "DEBUG url:%s\n", ctx->cfg.gerrit_project_list_url);
-#endif
+/* The visible project list depends on the Gerrit account, so the cache is
+ * keyed by REMOTE_USER and the GerritAccount session cookie: a fresh login
+ * never picks up a list fetched for an older session.
+ */
+static void project_list_cache_path(struct cgit_context *ctx, const char *user,
+				    struct strbuf *path)
+{
+	static const char cookie_name[] = "GerritAccount=";
+	const char *cookie = getenv("HTTP_COOKIE");
+	const char *session = NULL, *end;
+	unsigned char sha1[20];
+	git_SHA_CTX c;
+
+	if (cookie && (session = strstr(cookie, cookie_name)))
+		session += sizeof(cookie_name) - 1;
+
+	git_SHA1_Init(&c);
+	git_SHA1_Update(&c, user, strlen(user) + 1);
+	if (session) {
+		end = strchrnul(session, ';');
+		git_SHA1_Update(&c, session, end - session);
+	}
+	git_SHA1_Final(sha1, &c);
+	strbuf_addf(path, "%s/gerrit-%s", ctx->cfg.cache_root, sha1_to_hex(sha1));
+}
+
+/* The cached list holds one project name per line after this header. A
+ * file in another format (e.g. the json kept by older versions) is a miss.
+ */
+#define PROJECT_LIST_HEADER "cgit-project-list 1\n"
+
+static int load_project_list(const char *path, struct string_list *projects)
+{
+	char *buf, *p, *eol;
+	size_t size;
+
+	if (readfile(path, &buf, &size))
+		return -1;
+	if (prefixcmp(buf, PROJECT_LIST_HEADER)) {
+		free(buf);
+		return -1;
+	}
+	for (p = buf + strlen(PROJECT_LIST_HEADER); *p; p = eol + 1) {
+		eol = strchrnul(p, '\n');
+		if (!*eol)
+			break;
+		*eol = '\0';
+		string_list_append(projects, p);
+	}
+	free(buf);
+	return 0;
+}
+
+/* Write the project list to 'f', opened on the lockfile 'locked', and move
+ * it into place as 'path'. Returns 0 on success.
+ */
+static int commit_project_list(FILE *f, const char *locked, const char *path,
+			       const struct string_list *projects)
+{
+	struct string_list_item *item;
+	int failed, result = 0;
+
+	fputs(PROJECT_LIST_HEADER, f);
+	for_each_string_list_item(item, projects)
+		fprintf(f, "%s\n", item->string);
+	failed = ferror(f);
+	if (fclose(f) || failed) {
+		result = errno;
+		fprintf(stderr, "[cgit] Error writing %s: %s (%d)\n",
+			locked, strerror(result), result);
+		unlink(locked);
+		return result;
+	}
+	if (rename(locked, path)) {
+		result = errno;
+		fprintf(stderr, "[cgit] Error renaming %s to %s: %s (%d)\n",
+			locked, path, strerror(result), result);
+		unlink(locked);
+	}
+	return result;
+}
+
+/* Save the project list in 'path' and return 0 on success. A lockfile
+ * makes sure that only one process at a time refreshes a given user's list.
+ */
+static int store_project_list(const char *path, const struct string_list *projects)
+{
+	struct strbuf locked = STRBUF_INIT;
+	int result;
+	FILE *f;
+
+	strbuf_addf(&locked, "%s.lock", path);
+	f = fopen(locked.buf, "wx");
+	if (!f) {
+		result = errno;
+		if (result != EEXIST)
+			fprintf(stderr, "[cgit] Error opening %s: %s (%d)\n",
+				locked.buf, strerror(result), result);
+	} else
+		result = commit_project_list(f, locked.buf, path, projects);
+	strbuf_release(&locked);
+	return result;
+}
+
+/* While Gerrit doesn't answer, the last list fetched for the user is used
+ * however old it is: a page showing what was visible a moment ago is
+ * better than an empty one.
+ */
+static int load_stale_project_list(const char *path, struct string_list *projects)
+{
+	if (load_project_list(path, projects))
+		return -1;
+	fprintf(stderr, "[cgit] Gerrit unavailable, using the project list in %s\n",
+		path);
+	return 0;
+}
+
+/* Load the list cached for the user if it is younger than
+ * gerrit-project-list-ttl.
+ */
+static int load_fresh_project_list(struct cgit_context *ctx, const char *path,
+				   struct string_list *projects)
+{
+	struct stat st;
+
+	if (ctx->cfg.gerrit_project_list_ttl <= 0 || stat(path, &st) ||
+	    time(NULL) - st.st_mtime > ctx->cfg.gerrit_project_list_ttl * 60)
+		return -1;
+	return load_project_list(path, projects);
+}
+
+/* Close whatever a background child inherited except stderr and 'keep'. A
+ * persistent
+ * cgit refreshes while the client's connection is still open, and the
+ * webserver only sees the end of the answer once every copy of it is closed.
+ */
+static void close_inherited_fds(int keep)
+{
+	struct dirent *ent;
+	DIR *dir;
+	long fd, max;
+
+	dir = opendir("/proc/self/fd");
+	if (dir) {
+		while ((ent = readdir(dir)) != NULL) {
+			fd = strtol(ent->d_name, NULL, 10);
+			if (fd > STDERR_FILENO && fd != keep &&
+			    fd != dirfd(dir))
+				close(fd);
+		}
+		closedir(dir);
+		return;
+	}
+	max = sysconf(_SC_OPEN_MAX);
+	for (fd = STDERR_FILENO + 1; fd < max; fd++)
+		if (fd != keep)
+			close(fd);
+}
+
+/* Refetch the project list in a child process, so that the current request
+ * can be served from the stale copy without waiting for Gerrit. This is the
+ * same trick process_cached_repolist() plays with the scan-path repolist.
+ * The lockfile is taken before forking, so of all the requests finding the
+ * list stale only one calls Gerrit; the child writes the new list into it.
+ */
+static void refresh_project_list(struct cgit_context *ctx, char *remote_user,
+				 const char *path)
+{
+	struct strbuf locked = STRBUF_INIT;
+	struct string_list projects = STRING_LIST_INIT_DUP;
+	struct stat st;
+	int devnull, fd, ret;
+	pid_t pid;
+	FILE *f;
+
+	/* A lockfile left behind by a crashed refresh must not pin the
+	 * stale list forever.
+	 */
+	strbuf_addf(&locked, "%s.lock", path);
+	if (!stat(locked.buf, &st) && time(NULL) - st.st_mtime > 60)
+		unlink(locked.buf);
+	fd = open(locked.buf, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		/* Another process is refreshing it already. */
+		if (errno != EEXIST)
+			fprintf(stderr, "[cgit] Error opening %s: %s (%d)\n",
+				locked.buf, strerror(errno), errno);
+		strbuf_release(&locked);
+		return;
+	}
+
+	pid = fork();
+	if (pid) {
+		if (pid < 0) {
+			fprintf(stderr, "[cgit] Error forking: %s (%d)\n",
+				strerror(errno), errno);
+			unlink(locked.buf);
+		}
+		close(fd);
+		strbuf_release(&locked);
+		return;
+	}
+	gerrit_curl_forget();
+
+	/* Don't keep the webserver waiting for our stdout, or the client
+	 * connection of the request, to close.
+	 */
+	close_inherited_fds(fd);
+	devnull = open("/dev/null", O_RDWR);
+	if (devnull >= 0) {
+		dup2(devnull, STDIN_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+		if (devnull > STDERR_FILENO)
+			close(devnull);
+	}
+
+	ret = get_list(ctx, remote_user, &projects);
+	if (ret == 0 && (f = fdopen(fd, "w")))
+		exit(commit_project_list(f, locked.buf, path, &projects));
+	unlink(locked.buf);
+	if (ret == 1)
+		/* The session is gone, let the next request redirect to login. */
+		unlink(path);
+	exit(ret ? ret : errno);
+}
+
+/* Set up 'list' for the user of the current request. Returns the user, or
+ * NULL if the request has none.
+ */
+static char *init_project_list(struct gerrit_project_list *list) {
+  memset(list, 0, sizeof(*list));
+  list->status = -1;
   char * tmp_remote_user = getenv("REMOTE_USER");
   if( tmp_remote_user == NULL ) {
     tmp_remote_user = getenv("HTTP_X_FORWARDED_USER");
@@ -146,38 +824,176 @@ int gerrit_get_project_list(char *value, struct cgit_context *ctx, repo_config_f
 
   if( tmp_remote_user == NULL) {
     fprintf(stderr,"REMOET_USER or HTTP_X_FORWARDED_USER is NULL exit...\n");
-    return -1;
+    return NULL;
   }
-  char * remote_user = (char *)malloc( strlen(tmp_remote_user) + 1000);
-  sprintf(remote_user,"REMOTE_USER: %s", tmp_remote_user );
+  list->remote_user = (char *)malloc( strlen(tmp_remote_user) + 1000);
+  sprintf(list->remote_user,"REMOTE_USER: %s", tmp_remote_user );
 
 #ifdef MYDEBUG
 	fprintf(stderr,"DEBUG COOKIE:%s\n", getenv("HTTP_COOKIE")); 
 #endif
-	MemoryStruct chunk;
-	chunk.memory = (char *)malloc(1);
-	chunk.size = 0;
-	
-	/*	
-	MemoryStruct chunk2;
-	chunk2.memory = (char *)malloc(1);
-	chunk2.size = 0;
-	*/	
-
-	bool exitflag = false;
-	int ret = get_list(ctx, remote_user, &chunk);
-	if( ret == 0) {
-		const char * strjson = strstr((const char *)chunk.memory, "{");
-		if( strjson == NULL) {
-			fprintf(stderr,"error: failed to get json string\n");
+	list->chunk.memory = (char *)malloc(1);
+	list->chunk.size = 0;
+	list->projects.strdup_strings = 1;
+	return tmp_remote_user;
+}
+
+/* Ask Gerrit (or the per-user cache) for the projects the current user may
+ * see. Nothing is written to stdout here, so a persistent cgit can do this
+ * in the long-lived process and keep its connection to Gerrit.
+ */
+int gerrit_fetch_project_list(struct cgit_context *ctx, struct gerrit_project_list *list) {
+#ifdef MYDEBUG
+  fprintf(stderr, "DEBUG gerrit_get_project_list start\n");
+  fprintf(stderr,"DEBUG: REQUEST_URI:%s\n", getenv("REQUEST_URI"));
+  fprintf(stderr, "DEBUG url:%s\n", ctx->cfg.gerrit_project_list_url);
+#endif
+	char *tmp_remote_user = init_project_list(list);
+	if (!tmp_remote_user)
+		return -1;
+
+	bool from_cache = false;
+	int ret = -1;
+	struct strbuf cached = STRBUF_INIT;
+	struct stat st;
+
+	/* With the breaker the list is kept even without a ttl, to have
+	 * something to show while Gerrit is down.
+	 */
+	if (ctx->cfg.gerrit_project_list_ttl > 0 ||
+	    ctx->cfg.gerrit_breaker_failures > 0)
+		project_list_cache_path(ctx, tmp_remote_user, &cached);
+	if (ctx->cfg.gerrit_project_list_ttl > 0) {
+		if (!stat(cached.buf, &st) &&
+		    !load_project_list(cached.buf, &list->projects)) {
+			ret = 0;
+			from_cache = true;
+			if (time(NULL) - st.st_mtime > ctx->cfg.gerrit_project_list_ttl * 60)
+				refresh_project_list(ctx, list->remote_user, cached.buf);
 		}
-		gerrit_scan_projects(value, strjson, repo_config);
 	}
-	else if( ret == 1) {
+#ifdef MYDEBUG
+	fprintf(stderr, "DEBUG project list cache %s: %s\n", cached.len ? cached.buf : "(disabled)", from_cache ? "hit" : "miss");
+#endif
+	if (ret) {
+		ret = get_list(ctx, list->remote_user, &list->projects);
+		if (ret == 0 && cached.len)
+			store_project_list(cached.buf, &list->projects);
+		else if (ret < 0 && cached.len &&
+			 !load_stale_project_list(cached.buf, &list->projects))
+			ret = 0;
+	}
+	strbuf_release(&cached);
+	list->status = ret;
+	return ret;
+}
+
+/* Ask Gerrit whether the current user may see the single project 'name'.
+ * A page about one repository needs nothing else, and Gerrit answers this
+ * from its project cache instead of checking every project of the site.
+ * 'list' is filled as by gerrit_fetch_project_list() and holds 'name' if the
+ * project is visible, nothing if it isn't. A fresh cached list of the user
+ * answers without asking Gerrit at all.
+ */
+int gerrit_fetch_project(struct cgit_context *ctx, const char *name,
+			 struct gerrit_project_list *list) {
+	CURLcode res;
+	CURL *curl;
+	struct curl_slist *headers = NULL;
+	struct strbuf url = STRBUF_INIT;
+	struct strbuf cached = STRBUF_INIT;
+	struct string_list known = STRING_LIST_INIT_DUP;
+	MemoryStruct body;
+	char *escaped, *user;
+	long code = 0;
+	int ret = -1;
+
+	if (!(user = init_project_list(list)))
+		return -1;
+	if (ctx->cfg.gerrit_project_list_ttl > 0 ||
+	    ctx->cfg.gerrit_breaker_failures > 0)
+		project_list_cache_path(ctx, user, &cached);
+	if (cached.len && !load_fresh_project_list(ctx, cached.buf, &known)) {
+		if (unsorted_string_list_has_string(&known, name))
+			string_list_append(&list->projects, name);
+		string_list_clear(&known, 0);
+		strbuf_release(&cached);
+		list->status = 0;
+		return 0;
+	}
+	curl = gerrit_handle();
+	/* Project names contain '/', which Gerrit wants as %2F. */
+	escaped = curl_easy_escape(curl, name, 0);
+	strbuf_addstr(&url, ctx->cfg.gerrit_project_list_url);
+	if (url.len && url.buf[url.len - 1] != '/')
+		strbuf_addch(&url, '/');
+	strbuf_addstr(&url, escaped);
+	curl_free(escaped);
+
+	body.memory = (char *)malloc(1);
+	body.size = 0;
+	body.alloc = 0;
+	headers = curl_slist_append(headers, list->remote_user);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_URL, url.buf);
+	curl_easy_setopt(curl, CURLOPT_COOKIE,getenv("HTTP_COOKIE") );
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&body);
+	res = gerrit_perform(ctx, curl);
+	curl_slist_free_all(headers);
+	if (res != CURLE_OK)
+		fprintf(stderr, "error: gerrit_fetch_project curl_easy_perform() failed: %s url: %s\n", curl_easy_strerror(res), url.buf);
+	else {
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+#ifdef MYDEBUG
+		fprintf(stderr, "DEBUG project %s: %ld\n", name, code);
+#endif
+		if (code == 401 || (body.size >= 12 &&
+				    !memcmp(body.memory, "Unauthorized", 12)))
+			ret = 1;
+		else if (code == 200) {
+			string_list_append(&list->projects, name);
+			ret = 0;
+		} else if (code == 403 || code == 404)
+			/* Gerrit hides projects the user can't read. */
+			ret = 0;
+		else
+			fprintf(stderr, "error: gerrit_fetch_project unexpected answer %ld url: %s\n", code, url.buf);
+	}
+	if (ret < 0 && cached.len &&
+	    !load_stale_project_list(cached.buf, &known)) {
+		if (unsorted_string_list_has_string(&known, name))
+			string_list_append(&list->projects, name);
+		ret = 0;
+	}
+	string_list_clear(&known, 0);
+	free(body.memory);
+	strbuf_release(&url);
+	strbuf_release(&cached);
+	list->status = ret;
+	return ret;
+}
+
+/* Use a fetched project list: either scan each project below 'value'
+ * (repo_config set) or filter the repositories that were already added to
+ * cgit_repolist from index 'start' onwards. If the user isn't logged in to
+ * Gerrit, this answers the request with a redirect and exits.
+ */
+int gerrit_apply_project_list(struct gerrit_project_list *list, char *value,
+			      struct cgit_context *ctx, int start, repo_config_fn repo_config) {
+	if( list->status == 0) {
+		if (repo_config) {
+			timing_begin(TIMING_SCAN);
+			gerrit_scan_projects(value, &list->projects, repo_config);
+			metrics_scan(timing_end(TIMING_SCAN));
+		} else
+			gerrit_filter_projects(&list->projects, start);
+	}
+	else if( list->status == 1) {
 		htmlf("%s\n", "Content-Type: text/html;charset=utf-8");
 		htmlf("%s\n", "Content-Length: 0");
-		//int ret2 = get_login(ctx, remote_user, &chunk2);
-		int ret2 = get_login(ctx, remote_user, &chunk);
+		int ret2 = get_login(ctx, list->remote_user, &list->chunk);
 		if(ret2 == 0) {
 #ifdef MYDEBUG
 			fprintf(stderr, "DEBUG going to ctx->cfg.gerrit_cgit_url: %s\n", ctx->cfg.gerrit_cgit_url);
@@ -192,20 +1008,39 @@ int gerrit_get_project_list(char *value, struct cgit_context *ctx, repo_config_f
 			htmlf("%s%s\n", "Location: ", ctx->cfg.gerrit_index_url);
 		}
 		htmlf("\n");
-		exitflag  = true;
+		exit(0);
 	}
-	else if(ret == -1) {
+	else {
+		/* Without an answer from Gerrit nothing is visible. */
+		if (!repo_config)
+			cgit_repolist.count = start;
 	}
+	return 0;
+}
+
+void gerrit_release_project_list(struct gerrit_project_list *list) {
+	free(list->remote_user);
+	free(list->chunk.memory);
+	string_list_clear(&list->projects, 0);
+	memset(list, 0, sizeof(*list));
+	list->status = -1;
+}
 
-	//cleanup
-	free(remote_user);
-	free(chunk.memory);
-	//free(chunk2.memory);
+int gerrit_get_project_list(char *value, struct cgit_context *ctx, repo_config_fn repo_config) {
+	struct gerrit_project_list list;
+
+	gerrit_fetch_project_list(ctx, &list);
+	gerrit_apply_project_list(&list, value, ctx, 0, repo_config);
+	gerrit_release_project_list(&list);
+	return 0;
+}
 
+int gerrit_filter_repolist(struct cgit_context *ctx, int start) {
+	struct gerrit_project_list list;
 
-	if(exitflag) {
-		exit(0);
-	}
+	gerrit_fetch_project_list(ctx, &list);
+	gerrit_apply_project_list(&list, NULL, ctx, start, NULL);
+	gerrit_release_project_list(&list);
 	return 0;
 }
 
@@ -5,10 +5,38 @@
 typedef struct _MemoryStruct {
   char *memory;
   size_t size;
+  size_t alloc;        /* allocated, 0 if not known */
 } MemoryStruct;
 
+/* Takes the project names out of Gerrit's project list json while it is
+ * received, instead of keeping the answer and building the whole document.
+ */
+struct gerrit_list_parser {
+  struct string_list *projects;
+  struct strbuf key;   /* project name being read */
+  struct strbuf head;  /* start of the answer, to tell "Unauthorized" */
+  int state;
+  int depth;
+  int want_key;
+  unsigned int hex, hex_digits, surrogate;
+};
+
+struct gerrit_project_list {
+  int status;          /* 0: fetched, 1: login required, -1: no answer */
+  char *remote_user;   /* "REMOTE_USER: <user>" request header */
+  MemoryStruct chunk;  /* headers of the login answer */
+  struct string_list projects;  /* names of the visible projects */
+};
+
 int gerrit_connect(const char *url, MemoryStruct *chunk);
+int gerrit_fetch_project_list(struct cgit_context *ctx, struct gerrit_project_list *list);
+int gerrit_fetch_project(struct cgit_context *ctx, const char *name, struct gerrit_project_list *list);
+int gerrit_apply_project_list(struct gerrit_project_list *list, char *value, struct cgit_context *ctx, int start, repo_config_fn repo_config);
+void gerrit_release_project_list(struct gerrit_project_list *list);
 int gerrit_get_project_list(char *value, struct cgit_context *ctx, repo_config_fn repo_config); 
+int gerrit_filter_repolist(struct cgit_context *ctx, int start);
 int parse_json(const char *data); 
+void gerrit_curl_cleanup(void);
+void gerrit_curl_forget(void);
 
 #endif
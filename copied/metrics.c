@@ -0,0 +1,236 @@
+/* metrics.c: counters shared by all cgit processes
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+#include "cgit.h"
+#include "html.h"
+#include "metrics.h"
+#include "timing.h"
+
+#define METRICS_MAGIC "CGMT"
+#define METRICS_VERSION 2
+
+static const char *page_names[] = {
+	"about", "atom", "blob", "commit", "diff", "info", "log", "ls_cache",
+	"metrics", "objects", "patch", "plain", "refs", "repolist", "snapshot",
+	"stats", "summary", "tag", "tree", "other"
+};
+#define METRICS_PAGES (sizeof(page_names) / sizeof(page_names[0]))
+
+static const char *counter_names[METRICS_COUNTERS] = {
+	"cgit_cache_stale_total",
+	"cgit_cache_lock_waits_total",
+	"cgit_gerrit_failures_total",
+	"cgit_gerrit_connections_total",
+	"cgit_gerrit_connections_reused_total"
+};
+
+static const char *counter_help[METRICS_COUNTERS] = {
+	"Stale pages served while another process regenerated them.",
+	"Waits for a page cache shard lock.",
+	"Gerrit calls that failed or answered with a server error.",
+	"Connections opened to Gerrit.",
+	"Gerrit calls made over a connection kept from an earlier call."
+};
+
+static const char *cache_results[] = { "hit", "miss", "none" };
+
+/* Upper bounds of the histogram buckets in microseconds, the last bucket
+ * takes the rest (+Inf).
+ */
+static const uint64_t bucket_us[] = {
+	1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000
+};
+#define METRICS_BUCKETS (sizeof(bucket_us) / sizeof(bucket_us[0]) + 1)
+
+struct metrics_histogram {
+	uint64_t buckets[METRICS_BUCKETS];
+	uint64_t count;
+	uint64_t sum_us;
+};
+
+/* The file holds just this, zeroed when it is created. */
+struct metrics_data {
+	char magic[4];
+	uint32_t version;
+	uint64_t requests[METRICS_PAGES];
+	uint64_t cache[3];
+	uint64_t counters[METRICS_COUNTERS];
+	struct metrics_histogram request;
+	struct metrics_histogram gerrit;
+	struct metrics_histogram scan;
+};
+
+static struct metrics_data *metrics;
+
+static struct metrics_data *open_metrics(void)
+{
+	static int tried;
+	struct strbuf path = STRBUF_INIT;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (metrics || tried || !ctx.cfg.metrics || !ctx.cfg.cache_root)
+		return metrics;
+	tried = 1;
+	strbuf_addf(&path, "%s/metrics", ctx.cfg.cache_root);
+	fd = open(path.buf, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || fstat(fd, &st) ||
+	    (st.st_size < sizeof(*metrics) && ftruncate(fd, sizeof(*metrics)))) {
+		fprintf(stderr, "[cgit] Error opening %s: %s (%d)\n",
+			path.buf, strerror(errno), errno);
+		goto out;
+	}
+	map = mmap(NULL, sizeof(*metrics), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "[cgit] Error mapping %s: %s (%d)\n",
+			path.buf, strerror(errno), errno);
+		goto out;
+	}
+	metrics = map;
+	/* A fresh file is all zeroes, which is a valid empty set. */
+	if (!__atomic_load_n(&metrics->version, __ATOMIC_ACQUIRE)) {
+		memcpy(metrics->magic, METRICS_MAGIC, 4);
+		__atomic_store_n(&metrics->version, METRICS_VERSION,
+				 __ATOMIC_RELEASE);
+	} else if (memcmp(metrics->magic, METRICS_MAGIC, 4) ||
+		   metrics->version != METRICS_VERSION) {
+		fprintf(stderr, "[cgit] Ignoring %s: unknown format\n", path.buf);
+		munmap(map, sizeof(*metrics));
+		metrics = NULL;
+	}
+out:
+	if (fd >= 0)
+		close(fd);
+	strbuf_release(&path);
+	return metrics;
+}
+
+static void add(uint64_t *counter, uint64_t n)
+{
+	__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static void observe(struct metrics_histogram *h, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	size_t i;
+
+	for (i = 0; i < METRICS_BUCKETS - 1 && us > bucket_us[i]; i++)
+		;
+	add(&h->buckets[i], 1);
+	add(&h->count, 1);
+	add(&h->sum_us, us);
+}
+
+void metrics_count(enum metrics_counter counter)
+{
+	if (open_metrics())
+		add(&metrics->counters[counter], 1);
+}
+
+void metrics_gerrit(uint64_t ns, long connects, int failed)
+{
+	if (!open_metrics())
+		return;
+	observe(&metrics->gerrit, ns);
+	if (failed)
+		add(&metrics->counters[METRICS_GERRIT_FAILURE], 1);
+	/* connects is -1 if curl couldn't tell, which counts as neither. */
+	if (connects > 0)
+		add(&metrics->counters[METRICS_GERRIT_CONNECT], connects);
+	else if (!connects && !failed)
+		add(&metrics->counters[METRICS_GERRIT_REUSED], 1);
+}
+
+void metrics_scan(uint64_t ns)
+{
+	if (open_metrics())
+		observe(&metrics->scan, ns);
+}
+
+static size_t page_index(void)
+{
+	const char *page = ctx.qry.page;
+	size_t i;
+
+	if (!page)
+		page = ctx.repo ? "summary" : "repolist";
+	for (i = 0; i < METRICS_PAGES - 1; i++)
+		if (!strcmp(page, page_names[i]))
+			break;
+	return i;
+}
+
+void metrics_request(void)
+{
+	const char *result = timing_cache_result();
+	size_t i;
+
+	if (!open_metrics())
+		return;
+	add(&metrics->requests[page_index()], 1);
+	for (i = 0; i < ARRAY_SIZE(cache_results); i++)
+		if (!strcmp(result, cache_results[i]))
+			add(&metrics->cache[i], 1);
+	observe(&metrics->request, timing_total());
+}
+
+static uint64_t load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void print_histogram(const char *name, const char *help,
+			    const struct metrics_histogram *h)
+{
+	uint64_t total = 0;
+	size_t i;
+
+	htmlf("# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+		total += load(&h->buckets[i]);
+		htmlf("%s_bucket{le=\"%g\"} %"PRIu64"\n", name,
+		      bucket_us[i] / 1e6, total);
+	}
+	total += load(&h->buckets[i]);
+	htmlf("%s_bucket{le=\"+Inf\"} %"PRIu64"\n", name, total);
+	htmlf("%s_sum %.6f\n", name, load(&h->sum_us) / 1e6);
+	htmlf("%s_count %"PRIu64"\n", name, load(&h->count));
+}
+
+int metrics_print(void)
+{
+	size_t i;
+
+	if (!ctx.cfg.metrics)
+		fprintf(stderr, "[cgit] metrics isn't set in cgitrc\n");
+	if (!open_metrics())
+		return 1;
+	html("# HELP cgit_requests_total Requests served, by page.\n"
+	     "# TYPE cgit_requests_total counter\n");
+	for (i = 0; i < METRICS_PAGES; i++)
+		htmlf("cgit_requests_total{page=\"%s\"} %"PRIu64"\n",
+		      page_names[i], load(&metrics->requests[i]));
+	html("# HELP cgit_cache_requests_total Requests by page cache result.\n"
+	     "# TYPE cgit_cache_requests_total counter\n");
+	for (i = 0; i < ARRAY_SIZE(cache_results); i++)
+		htmlf("cgit_cache_requests_total{result=\"%s\"} %"PRIu64"\n",
+		      cache_results[i], load(&metrics->cache[i]));
+	for (i = 0; i < METRICS_COUNTERS; i++)
+		htmlf("# HELP %s %s\n# TYPE %s counter\n%s %"PRIu64"\n",
+		      counter_names[i], counter_help[i], counter_names[i],
+		      counter_names[i], load(&metrics->counters[i]));
+	print_histogram("cgit_request_duration_seconds",
+			"Time to answer a request.", &metrics->request);
+	print_histogram("cgit_gerrit_duration_seconds",
+			"Time of a Gerrit call.", &metrics->gerrit);
+	print_histogram("cgit_scan_duration_seconds",
+			"Time to scan a scan-path.", &metrics->scan);
+	return 0;
+}
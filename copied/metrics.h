@@ -0,0 +1,34 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "cgit.h"
+
+/*
+ * Counters and latency histograms shared by every cgit process through a
+ * memory mapped file below cache-root, updated with atomic adds. Enabled
+ * by the metrics option, served as Prometheus text by p=metrics (for the
+ * clients in metrics-allow) and printed by cgit --metrics.
+ */
+enum metrics_counter {
+	METRICS_CACHE_STALE,	/* stale page served while another fills it */
+	METRICS_CACHE_LOCK_WAIT,	/* waited for a page cache shard lock */
+	METRICS_GERRIT_FAILURE,
+	METRICS_GERRIT_CONNECT,	/* connections opened to Gerrit */
+	METRICS_GERRIT_REUSED,	/* Gerrit calls over a kept connection */
+	METRICS_COUNTERS
+};
+
+extern void metrics_count(enum metrics_counter counter);
+/* A Gerrit call that took 'ns', opened 'connects' connections (0: it
+ * reused one, if it got through at all; -1: unknown) and maybe failed.
+ */
+extern void metrics_gerrit(uint64_t ns, long connects, int failed);
+extern void metrics_scan(uint64_t ns);
+
+/* Count the request that is ending, from ctx and its timing. */
+extern void metrics_request(void);
+
+/* Print the metrics as Prometheus text. Returns 0 on success. */
+extern int metrics_print(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,942 @@
+/* page-cache.c: sharded, memory mapped store for cached pages
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+#include "cgit.h"
+#include "metrics.h"
+#include "page-cache.h"
+#include "timing.h"
+
+#define PAGE_CACHE_MAGIC "CGPC"
+#define PAGE_CACHE_VERSION 2
+
+/*
+ * Shard layout, in host byte order since the cache never leaves cache-root:
+ *
+ *   header | slots[nslots] | data[data_size]
+ *
+ * A slot holds the 64-bit hash of a key (0 for an empty slot) and the
+ * offset of its entry in the data region; collisions are resolved by linear
+ * probing. Entries are appended to the data region. A page that is replaced
+ * leaves a dead entry behind, which is dropped when the region is full and
+ * gets compacted; if that isn't enough the oldest pages are evicted.
+ *
+ * Writers take an fcntl() lock on the shard (not flock(), the shard files
+ * are shared with forked children) and keep 'seq' odd while they change it.
+ * Readers copy a page out and only use it if 'seq' was even and didn't
+ * change meanwhile.
+ */
+struct page_cache_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t seq;
+	uint64_t data_size;
+	uint64_t data_used;
+	uint32_t count;
+	uint32_t pad[7];
+};
+
+struct page_cache_slot {
+	uint64_t hash;
+	uint64_t offset;
+};
+
+/* Followed by the key, a NUL and 'size' bytes of page, padded to 8 bytes.
+ * The last 'gzip_size' bytes of the page are its gzip variant, see
+ * gzip_page().
+ */
+struct page_cache_entry {
+	uint64_t hash;
+	uint32_t keylen;
+	uint32_t size;
+	int64_t created;
+	int64_t filling;	/* when a process started to regenerate it */
+	uint32_t gzip_size;
+	uint32_t pad;
+};
+
+struct page_cache_shard {
+	int fd;
+	char *map;
+	size_t size;
+	struct page_cache_header *header;
+	struct page_cache_slot *slots;
+	char *data;
+};
+
+static struct page_cache_shard *shards;
+static int nshards;
+
+static uint64_t hash_key(const char *key)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash ? hash : 1;
+}
+
+static uint64_t entry_len(uint32_t keylen, uint32_t size)
+{
+	return (sizeof(struct page_cache_entry) + keylen + 1 + size + 7) & ~7ULL;
+}
+
+static size_t shard_size(uint32_t nslots, uint64_t data_size)
+{
+	return sizeof(struct page_cache_header) +
+		nslots * sizeof(struct page_cache_slot) + data_size;
+}
+
+/* The entry at 'offset' and its key and page length, or NULL if it can't
+ * be one. Readers may look at a shard while it changes, so every field is
+ * read once and checked before it is used.
+ */
+static struct page_cache_entry *shard_entry(struct page_cache_shard *s,
+					    uint64_t offset, uint32_t *keylen,
+					    uint32_t *size)
+{
+	struct page_cache_entry *e;
+	uint64_t data_size = s->header->data_size;
+
+	if (offset % 8 || offset + sizeof(*e) > data_size)
+		return NULL;
+	e = (struct page_cache_entry *)(s->data + offset);
+	*keylen = __atomic_load_n(&e->keylen, __ATOMIC_RELAXED);
+	*size = __atomic_load_n(&e->size, __ATOMIC_RELAXED);
+	if (*keylen > data_size || *size > data_size ||
+	    offset + entry_len(*keylen, *size) > data_size)
+		return NULL;
+	return e;
+}
+
+static int lock_shard(struct page_cache_shard *s, int type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	if (!fcntl(s->fd, F_SETLK, &fl))
+		return 0;
+	if (errno == EACCES || errno == EAGAIN)
+		metrics_count(METRICS_CACHE_LOCK_WAIT);
+	while (fcntl(s->fd, F_SETLKW, &fl)) {
+		if (errno != EINTR)
+			return errno;
+	}
+	return 0;
+}
+
+static void begin_write(struct page_cache_shard *s)
+{
+	__atomic_add_fetch(&s->header->seq, 1, __ATOMIC_ACQ_REL);
+}
+
+static void end_write(struct page_cache_shard *s)
+{
+	__atomic_add_fetch(&s->header->seq, 1, __ATOMIC_RELEASE);
+}
+
+/* Take the write lock of a shard. An odd 'seq' under the lock means that a
+ * writer was killed halfway through a change (a CGI timeout, the OOM
+ * killer), which leaves the index and data untrustworthy: the shard is
+ * emptied and 'seq' made even again, readers reject it meanwhile.
+ */
+static int write_lock_shard(struct page_cache_shard *s)
+{
+	struct page_cache_header *h = s->header;
+
+	if (lock_shard(s, F_WRLCK))
+		return -1;
+	if (__atomic_load_n(&h->seq, __ATOMIC_ACQUIRE) & 1) {
+		fprintf(stderr, "[cgit] Emptying a page cache shard a writer "
+			"left halfway through a change\n");
+		memset(s->slots, 0, h->nslots * sizeof(*s->slots));
+		h->data_used = 0;
+		h->count = 0;
+		end_write(s);
+	}
+	return 0;
+}
+
+/* The slot of 'key', or -1. */
+static int find_slot(struct page_cache_shard *s, const char *key,
+		     uint32_t keylen, uint64_t hash)
+{
+	struct page_cache_entry *e;
+	uint32_t mask = s->header->nslots - 1, i, n, len, size;
+	uint64_t slot_hash;
+
+	for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+		slot_hash = __atomic_load_n(&s->slots[i].hash, __ATOMIC_RELAXED);
+		if (!slot_hash)
+			break;
+		if (slot_hash != hash)
+			continue;
+		e = shard_entry(s, __atomic_load_n(&s->slots[i].offset,
+						   __ATOMIC_RELAXED), &len, &size);
+		if (e && len == keylen && !memcmp((char *)(e + 1), key, keylen))
+			return i;
+	}
+	return -1;
+}
+
+/* The slot pointing at the entry at 'offset', or -1 for a dead entry. */
+static int find_offset(struct page_cache_shard *s, uint64_t hash,
+		       uint64_t offset)
+{
+	uint32_t mask = s->header->nslots - 1, i, n;
+
+	for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+		if (!s->slots[i].hash)
+			break;
+		if (s->slots[i].hash == hash && s->slots[i].offset == offset)
+			return i;
+	}
+	return -1;
+}
+
+/* Empty slot 'i', moving later slots of the same run back so that lookups
+ * never stop early at the hole.
+ */
+static void delete_slot(struct page_cache_shard *s, uint32_t i)
+{
+	uint32_t mask = s->header->nslots - 1, j = i, home;
+
+	s->header->count--;
+	for (;;) {
+		s->slots[i].hash = 0;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (!s->slots[j].hash)
+				return;
+			home = s->slots[j].hash & mask;
+			if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+				break;
+		}
+		s->slots[i] = s->slots[j];
+		i = j;
+	}
+}
+
+static void insert_slot(struct page_cache_shard *s, uint64_t hash,
+			uint64_t offset)
+{
+	uint32_t mask = s->header->nslots - 1, i;
+
+	for (i = hash & mask; s->slots[i].hash; i = (i + 1) & mask)
+		;
+	s->slots[i].offset = offset;
+	s->slots[i].hash = hash;
+	s->header->count++;
+}
+
+/* Move the live entries to the start of the data region, evicting the
+ * oldest ones until 'need' more bytes and one more slot fit.
+ */
+static void compact_shard(struct page_cache_shard *s, uint64_t need)
+{
+	struct page_cache_header *h = s->header;
+	struct page_cache_entry *e;
+	uint64_t off, dst, len, live = 0;
+	uint32_t max_count = h->nslots / 4 * 3;
+	int i;
+
+	for (off = 0; off < h->data_used; off += len) {
+		e = (struct page_cache_entry *)(s->data + off);
+		len = entry_len(e->keylen, e->size);
+		if (find_offset(s, e->hash, off) >= 0)
+			live += len;
+	}
+	for (off = dst = 0; off < h->data_used; off += len) {
+		e = (struct page_cache_entry *)(s->data + off);
+		len = entry_len(e->keylen, e->size);
+		i = find_offset(s, e->hash, off);
+		if (i < 0)
+			continue;
+		if (live + need > h->data_size || h->count >= max_count) {
+			delete_slot(s, i);
+			live -= len;
+			continue;
+		}
+		if (dst != off) {
+			memmove(s->data + dst, s->data + off, len);
+			s->slots[i].offset = dst;
+		}
+		dst += len;
+	}
+	h->data_used = dst;
+}
+
+/* Store 'page' and its gzip variant 'gzip' (empty if there is none) for
+ * 'key', replacing what it had before.
+ */
+static void store_page(struct page_cache_shard *s, const char *key,
+		       uint64_t hash, const struct strbuf *page,
+		       const struct strbuf *gzip)
+{
+	struct page_cache_header *h = s->header;
+	struct page_cache_entry *e;
+	uint32_t keylen = strlen(key);
+	uint64_t len = entry_len(keylen, page->len + gzip->len);
+	char *p;
+	int i;
+
+	if (len > h->data_size)
+		return;
+	if (write_lock_shard(s))
+		return;
+	begin_write(s);
+	i = find_slot(s, key, keylen, hash);
+	if (i >= 0)
+		delete_slot(s, i);
+	if (h->data_used + len > h->data_size || h->count >= h->nslots / 4 * 3)
+		compact_shard(s, len);
+	e = (struct page_cache_entry *)(s->data + h->data_used);
+	e->hash = hash;
+	e->keylen = keylen;
+	e->size = page->len + gzip->len;
+	e->gzip_size = gzip->len;
+	e->created = time(NULL);
+	e->filling = 0;
+	p = (char *)(e + 1);
+	memcpy(p, key, keylen + 1);
+	p += keylen + 1;
+	memcpy(p, page->buf, page->len);
+	memcpy(p + page->len, gzip->buf, gzip->len);
+	insert_slot(s, hash, h->data_used);
+	h->data_used += len;
+	end_write(s);
+	lock_shard(s, F_UNLCK);
+}
+
+/* Copy the page of 'key' into 'page', its gzip variant if 'gzip' is set
+ * and there is one. Returns 1 and sets 'created' and 'filling' if it is
+ * there, 0 if it isn't, and -1 if a writer was busy with the shard all
+ * along.
+ */
+static int try_read_page(struct page_cache_shard *s, const char *key,
+			 uint64_t hash, int gzip, struct strbuf *page,
+			 int64_t *created, int64_t *filling)
+{
+	struct page_cache_entry *e;
+	uint32_t seq, keylen = strlen(key), len, size, gzip_size;
+	const char *p;
+	int tries, i, found;
+
+	for (tries = 0; tries < 64; tries++) {
+		seq = __atomic_load_n(&s->header->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		found = 0;
+		i = find_slot(s, key, keylen, hash);
+		if (i >= 0 && (e = shard_entry(s, s->slots[i].offset, &len, &size))) {
+			p = (char *)(e + 1) + len + 1;
+			gzip_size = __atomic_load_n(&e->gzip_size, __ATOMIC_RELAXED);
+			if (gzip_size > size)
+				gzip_size = 0;
+			strbuf_reset(page);
+			if (gzip && gzip_size)
+				strbuf_add(page, p + size - gzip_size, gzip_size);
+			else
+				strbuf_add(page, p, size - gzip_size);
+			*created = e->created;
+			*filling = e->filling;
+			found = 1;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->header->seq, __ATOMIC_RELAXED) == seq)
+			return found;
+	}
+	return -1;
+}
+
+static int read_page(struct page_cache_shard *s, const char *key,
+		     uint64_t hash, int gzip, struct strbuf *page,
+		     int64_t *created, int64_t *filling)
+{
+	int found = try_read_page(s, key, hash, gzip, page, created, filling);
+
+	/* Wait for the writer instead of spinning on. */
+	if (found < 0 && !lock_shard(s, F_RDLCK)) {
+		found = try_read_page(s, key, hash, gzip, page, created, filling);
+		lock_shard(s, F_UNLCK);
+	}
+	return found > 0;
+}
+
+/* Mark the expired page of 'key' as being regenerated. Returns -1 if another
+ * process does that already; it then keeps serving the stale page, like
+ * cache.c does while a slot is locked.
+ */
+static int claim_page(struct page_cache_shard *s, const char *key, uint64_t hash)
+{
+	struct page_cache_entry *e;
+	time_t now = time(NULL);
+	uint32_t len, size;
+	int i, result = 0;
+
+	if (write_lock_shard(s))
+		return 0;
+	i = find_slot(s, key, strlen(key), hash);
+	if (i >= 0 && (e = shard_entry(s, s->slots[i].offset, &len, &size))) {
+		if (e->filling && now - e->filling < ctx.cfg.cache_max_create_time)
+			result = -1;
+		else {
+			begin_write(s);
+			e->filling = now;
+			end_write(s);
+		}
+	}
+	lock_shard(s, F_UNLCK);
+	return result;
+}
+
+static int map_shard(struct page_cache_shard *s, int fd, uint32_t nslots,
+		     uint64_t data_size)
+{
+	const struct page_cache_header *h;
+	size_t size = shard_size(nslots, data_size);
+	struct stat st;
+	char *map;
+
+	if (fstat(fd, &st) || st.st_size != size)
+		return -1;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	h = (const struct page_cache_header *)map;
+	if (memcmp(h->magic, PAGE_CACHE_MAGIC, sizeof(h->magic)) ||
+	    h->version != PAGE_CACHE_VERSION || h->nslots != nslots ||
+	    h->data_size != data_size) {
+		munmap(map, size);
+		return -1;
+	}
+	s->fd = fd;
+	s->map = map;
+	s->size = size;
+	s->header = (struct page_cache_header *)map;
+	s->slots = (struct page_cache_slot *)(map + sizeof(*h));
+	s->data = (char *)(s->slots + nslots);
+	return 0;
+}
+
+/* Write an empty shard next to 'filename' and move it into place. A shard
+ * of another size or version is replaced the same way, so processes which
+ * still map the old one never see it change under them.
+ */
+static int create_shard(const char *filename, uint32_t nslots,
+			uint64_t data_size)
+{
+	struct page_cache_header header;
+	struct strbuf lock = STRBUF_INIT;
+	struct stat st;
+	int fd, result = 0;
+
+	strbuf_addf(&lock, "%s.lock", filename);
+	/* A lockfile left behind by a crashed process must not keep the
+	 * shard from being created forever.
+	 */
+	if (!stat(lock.buf, &st) && time(NULL) - st.st_mtime > 60)
+		unlink(lock.buf);
+	fd = open(lock.buf, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		result = errno;
+		goto out;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PAGE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = PAGE_CACHE_VERSION;
+	header.nslots = nslots;
+	header.data_size = data_size;
+	/* The file is sparse: the index reads as empty slots. */
+	if (ftruncate(fd, shard_size(nslots, data_size)) ||
+	    write_in_full(fd, &header, sizeof(header)) < 0)
+		result = errno;
+	if (close(fd) && !result)
+		result = errno;
+	if (!result && rename(lock.buf, filename))
+		result = errno;
+	if (result)
+		unlink(lock.buf);
+out:
+	if (result && result != EEXIST)
+		fprintf(stderr, "[cgit] Error creating %s: %s (%d)\n",
+			filename, strerror(result), result);
+	strbuf_release(&lock);
+	return result;
+}
+
+static int open_shard(struct page_cache_shard *s, const char *filename,
+		      uint32_t nslots, uint64_t data_size)
+{
+	int fd, tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		fd = open(filename, O_RDWR);
+		if (fd >= 0) {
+			if (!map_shard(s, fd, nslots, data_size))
+				return 0;
+			close(fd);
+		}
+		if (create_shard(filename, nslots, data_size))
+			return -1;
+	}
+	return -1;
+}
+
+/* Where the shards live and how large they are, set up by setup_shards(). */
+static char *shard_path;
+static uint32_t shard_nslots;
+static uint64_t shard_data_size;
+
+static int setup_shards(const char *path, int size)
+{
+	uint32_t nslots = 64;
+	int n;
+
+	if (shards)
+		return 0;
+	if (!path || size <= 0 || ctx.cfg.cache_shards <= 0 ||
+	    ctx.cfg.cache_shard_size <= 0)
+		return -1;
+	n = ctx.cfg.cache_shards;
+	/* Keep the index at most half full for the pages of one shard. */
+	while (nslots < 2 * ((uint64_t)size + n - 1) / n && nslots < (1U << 30))
+		nslots *= 2;
+	shard_path = xstrdup(path);
+	shard_nslots = nslots;
+	shard_data_size = (uint64_t)ctx.cfg.cache_shard_size << 20;
+	shards = xcalloc(n, sizeof(*shards));
+	nshards = n;
+	return 0;
+}
+
+/* Map shard 'i' unless it already is. */
+static int map_index(int i)
+{
+	struct strbuf filename = STRBUF_INIT;
+	int result;
+
+	if (shards[i].map)
+		return 0;
+	strbuf_addf(&filename, "%s/pages-%02x", shard_path, i);
+	result = open_shard(&shards[i], filename.buf, shard_nslots,
+			    shard_data_size);
+	strbuf_release(&filename);
+	return result;
+}
+
+/* Map all shards for a cache of 'size' pages below 'path'. A persistent
+ * cgit does this before forking for the requests, which then look pages up
+ * without any system call. A CGI process doesn't call it and only maps the
+ * shard of the page it looks up, see page_cache_process().
+ */
+int page_cache_open(const char *path, int size)
+{
+	int i, result = 0;
+
+	if (setup_shards(path, size))
+		return -1;
+	for (i = 0; i < nshards; i++)
+		if (map_index(i))
+			result = -1;
+	return result;
+}
+
+/* Run 'fn' with stdout going to a temporary file, and read back what it
+ * printed. If the output can't be redirected 'fn' prints it directly, and
+ * -1 is returned.
+ */
+/* The output being captured, so that a page which exits halfway (HEAD
+ * requests, die()) still gets what it printed out, see finish_capture().
+ */
+static struct {
+	int fd;
+	int saved;
+} capture = { -1, -1 };
+
+static int open_capture(const char *path)
+{
+	struct strbuf tmp = STRBUF_INIT;
+	int fd = -1;
+
+#ifdef O_TMPFILE
+	fd = open(path, O_TMPFILE | O_RDWR, 0600);
+#endif
+	if (fd < 0) {
+		strbuf_addf(&tmp, "%s/pages-XXXXXX", path);
+		fd = mkstemp(tmp.buf);
+		if (fd >= 0)
+			unlink(tmp.buf);
+		strbuf_release(&tmp);
+	}
+	return fd;
+}
+
+/* The empty line after the headers of a captured page, or NULL if it has
+ * none. '*length' is set if they give the Content-Length.
+ */
+static const char *headers_end(const char *buf, size_t len, int *length)
+{
+	const char *end, *line, *eol;
+
+	*length = 0;
+	if (ctx.env.no_http && !strcmp(ctx.env.no_http, "1"))
+		return NULL;
+	end = memmem(buf, len, "\n\n", 2);
+	if (!end)
+		return NULL;
+	for (line = buf; line <= end; line = eol + 1) {
+		eol = memchr(line, '\n', end + 1 - line);
+		if (!prefixcmp(line, "Content-Length:"))
+			*length = 1;
+	}
+	return end + 1;
+}
+
+static void add_content_length(struct strbuf *page)
+{
+	int length;
+	const char *end = headers_end(page->buf, page->len, &length);
+	size_t pos;
+
+	if (!end || length)
+		return;
+	pos = end - page->buf;
+	end = fmt("Content-Length: %"PRIuMAX"\n",
+		  (uintmax_t)(page->len - pos - 1));
+	strbuf_insert(page, pos, end, strlen(end));
+}
+
+/* Server-Timing is only known when the page is sent, and never stored. */
+static void add_timing(struct strbuf *page)
+{
+	struct strbuf timing = STRBUF_INIT;
+	int length;
+	const char *end = headers_end(page->buf, page->len, &length);
+
+	if (end)
+		timing_header(&timing);
+	if (timing.len)
+		strbuf_insert(page, end - page->buf, timing.buf, timing.len);
+	strbuf_release(&timing);
+}
+
+/* Copy the output captured in 'fd' to stdout, with a Content-Length and
+ * Server-Timing added. Only the first block is looked at, the rest is
+ * copied as it is.
+ */
+static int send_captured(int fd)
+{
+	struct strbuf head = STRBUF_INIT;
+	char buf[65536];
+	const char *end;
+	off_t size;
+	ssize_t len;
+	int err = 0, length;
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0 || lseek(fd, 0, SEEK_SET) < 0)
+		return errno;
+	len = read_in_full(fd, buf, sizeof(buf));
+	if (len < 0)
+		return errno;
+	end = headers_end(buf, len, &length);
+	if (end) {
+		strbuf_add(&head, buf, end - buf);
+		if (!length)
+			strbuf_addf(&head, "Content-Length: %"PRIuMAX"\n",
+				    (uintmax_t)(size - (end + 1 - buf)));
+		timing_header(&head);
+		strbuf_add(&head, end, buf + len - end);
+	} else
+		strbuf_add(&head, buf, len);
+	if (write_in_full(STDOUT_FILENO, head.buf, head.len) < 0)
+		err = errno;
+	strbuf_release(&head);
+	while (!err && (len = xread(fd, buf, sizeof(buf))) > 0)
+		if (write_in_full(STDOUT_FILENO, buf, len) < 0)
+			err = errno;
+	if (len < 0 && !err)
+		err = errno;
+	return err;
+}
+
+static void end_capture(void)
+{
+	fflush(stdout);
+	dup2(capture.saved, STDOUT_FILENO);
+	close(capture.saved);
+	capture.saved = -1;
+}
+
+static void finish_capture(void)
+{
+	if (capture.fd < 0)
+		return;
+	end_capture();
+	send_captured(capture.fd);
+	close(capture.fd);
+	capture.fd = -1;
+}
+
+/* Run 'fn' with stdout going to a temporary file below 'path' (or /tmp),
+ * which is returned. If that can't be set up, 'fn' writes to stdout as
+ * usual and -1 is returned.
+ */
+static int capture_output(const char *path, cache_fill_fn fn, void *cbdata)
+{
+	static int registered;
+	int fd, saved;
+
+	fd = open_capture(path);
+	if (fd < 0 && strcmp(path, "/tmp"))
+		fd = open_capture("/tmp");
+	fflush(stdout);
+	saved = fd < 0 ? -1 : dup(STDOUT_FILENO);
+	if (saved < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+		fprintf(stderr, "[cgit] Error capturing page: %s (%d)\n",
+			strerror(errno), errno);
+		if (saved >= 0)
+			close(saved);
+		if (fd >= 0)
+			close(fd);
+		fn(cbdata);
+		return -1;
+	}
+	if (!registered) {
+		atexit(finish_capture);
+		registered = 1;
+	}
+	capture.fd = fd;
+	capture.saved = saved;
+	timing_defer(1);
+	fn(cbdata);
+	timing_defer(0);
+	end_capture();
+	capture.fd = -1;
+	return fd;
+}
+
+static int capture_page(const char *path, cache_fill_fn fn, void *cbdata,
+			struct strbuf *page)
+{
+	int fd, result = 0;
+
+	fd = capture_output(path, fn, cbdata);
+	if (fd < 0)
+		return -1;
+	strbuf_reset(page);
+	if (lseek(fd, 0, SEEK_SET) < 0 || strbuf_read(page, fd, 0) < 0)
+		result = errno;
+	close(fd);
+	add_content_length(page);
+	return result;
+}
+
+int page_buffer_process(const char *path, cache_fill_fn fn, void *cbdata)
+{
+	int fd, err;
+
+	fd = capture_output(path ? path : "/tmp", fn, cbdata);
+	if (fd < 0)
+		return 0;
+	err = send_captured(fd);
+	close(fd);
+	return err;
+}
+
+/* Whether the client takes gzip, from Accept-Encoding. */
+static int accepts_gzip(void)
+{
+	const char *p = getenv("HTTP_ACCEPT_ENCODING"), *end, *q;
+	size_t len;
+	int accept;
+
+	if (!p)
+		return 0;
+	while (*p) {
+		p += strspn(p, " \t,");
+		end = p + strcspn(p, ",");
+		len = strcspn(p, " \t;,");
+		accept = (len == 4 && !strncasecmp(p, "gzip", 4)) ||
+			(len == 6 && !strncasecmp(p, "x-gzip", 6)) ||
+			(len == 1 && *p == '*');
+		if (accept) {
+			/* "gzip;q=0" refuses it. */
+			for (q = p + len; q < end; q++)
+				if (*q == ';') {
+					q += strspn(q + 1, " \t") + 1;
+					if ((*q == 'q' || *q == 'Q') && q[1] == '=' &&
+					    strtod(q + 2, NULL) <= 0)
+						accept = 0;
+				}
+			if (accept)
+				return 1;
+		}
+		p = end;
+	}
+	return 0;
+}
+
+/* Whether a response of 'type' (the value of its Content-Type header) gets
+ * smaller with gzip. Snapshots, images and such are left alone.
+ */
+static int compressible(const char *type, size_t len)
+{
+	static const char *kinds[] = {"xml", "json", "javascript", NULL};
+	const char **kind;
+
+	if (len >= 5 && !strncasecmp(type, "text/", 5))
+		return 1;
+	for (kind = kinds; *kind; kind++)
+		if (memmem(type, len, *kind, strlen(*kind)))
+			return 1;
+	return 0;
+}
+
+/* Build the gzip variant of the response 'page' in 'gzip': the headers of
+ * 'page' with Content-Encoding added, followed by the compressed body. It
+ * is built once when the page is cached, so hits cost no compression.
+ * 'gzip' is left empty where compression doesn't pay off.
+ */
+static void gzip_page(const struct strbuf *page, struct strbuf *gzip)
+{
+	struct strbuf deflated = STRBUF_INIT;
+	const char *body, *line, *eol, *type = NULL;
+	size_t body_len, type_len = 0;
+	z_stream z;
+	int ret;
+
+	strbuf_reset(gzip);
+	/* Without http headers (NO_HTTP) there is nothing to go by. */
+	if (ctx.env.no_http && !strcmp(ctx.env.no_http, "1"))
+		return;
+	body = memmem(page->buf, page->len, "\n\n", 2);
+	if (!body)
+		return;
+	body += 2;
+	body_len = page->buf + page->len - body;
+	if (body_len < 256)
+		return;
+	for (line = page->buf; line < body - 1; line = eol + 1) {
+		eol = memchr(line, '\n', body - line);
+		if (!prefixcmp(line, "Content-Encoding:"))
+			return;
+		if (!prefixcmp(line, "Content-Type:")) {
+			type = line + strlen("Content-Type:");
+			type += strspn(type, " ");
+			type_len = eol - type;
+		}
+	}
+	if (!type || !compressible(type, type_len))
+		return;
+
+	for (line = page->buf; line < body - 1; line = eol + 1) {
+		eol = memchr(line, '\n', body - line);
+		/* Replaced below by the compressed length. */
+		if (!prefixcmp(line, "Content-Length:"))
+			continue;
+		/* A strong ETag names one representation, see etag_matches()
+		 * in cgit.c for the other end.
+		 */
+		if (!prefixcmp(line, "ETag: \"") && eol - line > 7 &&
+		    eol[-1] == '"') {
+			strbuf_add(gzip, line, eol - 1 - line);
+			strbuf_addstr(gzip, "-gz\"\n");
+			continue;
+		}
+		strbuf_add(gzip, line, eol + 1 - line);
+	}
+	strbuf_addstr(gzip, "Content-Encoding: gzip\nVary: Accept-Encoding\n");
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		strbuf_reset(gzip);
+		return;
+	}
+	strbuf_grow(&deflated, deflateBound(&z, body_len));
+	z.next_in = (unsigned char *)body;
+	z.avail_in = body_len;
+	z.next_out = (unsigned char *)deflated.buf;
+	z.avail_out = deflated.alloc - 1;
+	ret = deflate(&z, Z_FINISH);
+	deflateEnd(&z);
+	if (ret != Z_STREAM_END || z.total_out >= body_len)
+		strbuf_reset(gzip);
+	else {
+		strbuf_setlen(&deflated, z.total_out);
+		strbuf_addf(gzip, "Content-Length: %lu\n\n", z.total_out);
+		strbuf_addbuf(gzip, &deflated);
+	}
+	strbuf_release(&deflated);
+}
+
+int page_slot_process(int size, const char *path, const char *key, int ttl,
+		      cache_fill_fn fn, void *cbdata)
+{
+	int deferred = timing_deferred(), result;
+
+	/* The slot keeps the headers for whoever gets the page next. */
+	if (size > 0)
+		timing_defer(1);
+	result = cache_process(size, path, key, ttl, fn, cbdata);
+	timing_defer(deferred);
+	return result;
+}
+
+int page_cache_process(int size, const char *path, const char *key, int ttl,
+		       cache_fill_fn fn, void *cbdata)
+{
+	struct page_cache_shard *s;
+	struct strbuf page = STRBUF_INIT, gzipped = STRBUF_INIT;
+	int64_t created, filling;
+	uint64_t hash;
+	int found, gzip, err;
+
+	if (size <= 0 || !path)
+		return page_slot_process(size, path, key, ttl, fn, cbdata);
+	if (!key)
+		key = "";
+	hash = hash_key(key);
+	if (setup_shards(path, size) || map_index((hash >> 32) % nshards))
+		/* The file per slot store still works. */
+		return page_slot_process(size, path, key, ttl, fn, cbdata);
+	s = &shards[(hash >> 32) % nshards];
+	gzip = accepts_gzip();
+	found = read_page(s, key, hash, gzip, &page, &created, &filling);
+	if (found && (ttl < 0 || created + ttl * 60 >= time(NULL)))
+		goto print;
+	if (found && claim_page(s, key, hash)) {
+		metrics_count(METRICS_CACHE_STALE);
+		goto print;
+	}
+
+	/* Like cache.c, the request doesn't fail just because the page
+	 * can't be cached.
+	 */
+	err = capture_page(path, fn, cbdata, &page);
+	if (err) {
+		strbuf_release(&page);
+		return err < 0 ? 0 : err;
+	}
+	gzip_page(&page, &gzipped);
+	store_page(s, key, hash, &page, &gzipped);
+	if (gzip && gzipped.len)
+		strbuf_swap(&page, &gzipped);
+print:
+	err = 0;
+	add_timing(&page);
+	if (write_in_full(STDOUT_FILENO, page.buf, page.len) < 0)
+		err = errno;
+	strbuf_release(&page);
+	strbuf_release(&gzipped);
+	return err;
+}
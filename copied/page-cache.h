@@ -0,0 +1,33 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include "cache.h"
+
+/*
+ * Page cache kept in a fixed set of memory mapped shard files below
+ * cache-root, used instead of the file per slot store of cache.c when
+ * cache-shards is set. Each shard holds an open addressing index of 64-bit
+ * key hashes and an append-only data region with the pages and their full
+ * keys. Readers don't lock: a sequence counter in the shard tells them when
+ * a writer got in the way.
+ */
+extern int page_cache_open(const char *path, int size);
+extern int page_cache_process(int size, const char *path, const char *key,
+			      int ttl, cache_fill_fn fn, void *cbdata);
+
+/*
+ * cache_process() of the file per slot store. The pages it stores go out
+ * without a Server-Timing header, which would be wrong for every later hit.
+ */
+extern int page_slot_process(int size, const char *path, const char *key,
+			     int ttl, cache_fill_fn fn, void *cbdata);
+
+/*
+ * Run 'fn' with its output collected in a temporary file below 'path' and
+ * send it in large writes, with a Content-Length for pages that don't give
+ * one. Pages from page_cache_process() carry one as well.
+ */
+extern int page_buffer_process(const char *path, cache_fill_fn fn,
+			       void *cbdata);
+
+#endif /* PAGE_CACHE_H */
@@ -0,0 +1,251 @@
+/* repo-cache.c: memory mapped binary cache of a scanned repolist
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+#include "cgit.h"
+#include "repo-cache.h"
+
+#define REPO_CACHE_MAGIC "CGRC"
+#define REPO_CACHE_VERSION 1
+
+/*
+ * File layout, in host byte order since the cache never leaves cache-root:
+ *
+ *   header | records[count] | index[count] | strings[strings_size]
+ *
+ * 'rc_size' is the size of the text rc-* file generated together with this
+ * one, so a binary cache left over from an earlier scan isn't used.
+ */
+struct repo_cache_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+	uint32_t strings_size;
+	uint64_t rc_size;
+};
+
+struct repo_cache_entry {
+	uint32_t url;
+	uint32_t record;
+};
+
+struct repo_cache {
+	char *map;
+	size_t size;
+	const struct repo_cache_record *records;
+	const struct repo_cache_entry *index;
+	const char *strings;
+	uint32_t strings_size;
+	int count;
+};
+
+void repo_cache_writer_init(struct repo_cache_writer *w)
+{
+	strbuf_init(&w->records, 0);
+	strbuf_init(&w->strings, 0);
+	/* Offset 0 is NULL, never a real string. */
+	strbuf_addch(&w->strings, '\0');
+	w->count = 0;
+}
+
+uint32_t repo_cache_add_string(struct repo_cache_writer *w, const char *str)
+{
+	uint32_t offset = w->strings.len;
+
+	if (!str)
+		return 0;
+	strbuf_add(&w->strings, str, strlen(str) + 1);
+	return offset;
+}
+
+/* Add the NUL terminated strings in 'buf', to be read back one by one. */
+uint32_t repo_cache_add_strings(struct repo_cache_writer *w,
+				const struct strbuf *buf)
+{
+	uint32_t offset = w->strings.len;
+
+	if (!buf->len)
+		return 0;
+	strbuf_add(&w->strings, buf->buf, buf->len);
+	return offset;
+}
+
+void repo_cache_add_record(struct repo_cache_writer *w,
+			   const struct repo_cache_record *rec)
+{
+	strbuf_add(&w->records, rec, sizeof(*rec));
+	w->count++;
+}
+
+static const char *sort_strings;
+
+static int cmp_entries(const void *a, const void *b)
+{
+	const struct repo_cache_entry *ea = a, *eb = b;
+	int cmp = strcmp(sort_strings + ea->url, sort_strings + eb->url);
+
+	if (cmp)
+		return cmp;
+	return ea->record < eb->record ? -1 : ea->record > eb->record;
+}
+
+/* Write the cache to 'filename' through a lockfile. Returns 0 on success. */
+int repo_cache_commit(struct repo_cache_writer *w, const char *filename,
+		      uint64_t rc_size)
+{
+	const struct repo_cache_record *records;
+	struct repo_cache_header header;
+	struct repo_cache_entry *index;
+	struct strbuf lock = STRBUF_INIT;
+	int fd, i, result = 0;
+
+	records = (const struct repo_cache_record *)w->records.buf;
+	index = xcalloc(w->count ? w->count : 1, sizeof(*index));
+	for (i = 0; i < w->count; i++) {
+		index[i].url = records[i].url;
+		index[i].record = i;
+	}
+	sort_strings = w->strings.buf;
+	qsort(index, w->count, sizeof(*index), cmp_entries);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, REPO_CACHE_MAGIC, sizeof(header.magic));
+	header.version = REPO_CACHE_VERSION;
+	header.count = w->count;
+	header.strings_size = w->strings.len;
+	header.rc_size = rc_size;
+
+	strbuf_addf(&lock, "%s.lock", filename);
+	fd = open(lock.buf, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		result = errno;
+		goto out;
+	}
+	if (write_in_full(fd, &header, sizeof(header)) < 0 ||
+	    write_in_full(fd, w->records.buf, w->records.len) < 0 ||
+	    write_in_full(fd, index, w->count * sizeof(*index)) < 0 ||
+	    write_in_full(fd, w->strings.buf, w->strings.len) < 0)
+		result = errno;
+	if (close(fd) && !result)
+		result = errno;
+	if (!result && rename(lock.buf, filename))
+		result = errno;
+	if (result)
+		unlink(lock.buf);
+out:
+	if (result)
+		fprintf(stderr, "[cgit] Error writing %s: %s (%d)\n",
+			filename, strerror(result), result);
+	strbuf_release(&lock);
+	free(index);
+	return result;
+}
+
+void repo_cache_writer_release(struct repo_cache_writer *w)
+{
+	strbuf_release(&w->records);
+	strbuf_release(&w->strings);
+	w->count = 0;
+}
+
+/* Map the cache in 'filename' if it belongs to a text cache of 'rc_size'
+ * bytes, returning NULL if it can't be used.
+ *
+ * The mapping is never unmapped since the repositories loaded from it point
+ * into it. It is private and writable, so should anything modify such a
+ * string it only gets its own copy of the page.
+ */
+struct repo_cache *repo_cache_open(const char *filename, uint64_t rc_size)
+{
+	const struct repo_cache_header *header;
+	struct repo_cache *cache;
+	struct stat st;
+	size_t size;
+	char *map;
+	int fd, i;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || st.st_size < sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+	size = xsize_t(st.st_size);
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	header = (const struct repo_cache_header *)map;
+	if (memcmp(header->magic, REPO_CACHE_MAGIC, sizeof(header->magic)) ||
+	    header->version != REPO_CACHE_VERSION ||
+	    header->rc_size != rc_size || !header->strings_size ||
+	    size != sizeof(*header) + (uint64_t)header->count *
+		    (sizeof(struct repo_cache_record) + sizeof(struct repo_cache_entry)) +
+		    header->strings_size ||
+	    map[size - 1] != '\0')
+		goto invalid;
+
+	cache = xmalloc(sizeof(*cache));
+	cache->map = map;
+	cache->size = size;
+	cache->count = header->count;
+	cache->records = (const struct repo_cache_record *)(map + sizeof(*header));
+	cache->index = (const struct repo_cache_entry *)(cache->records + cache->count);
+	cache->strings = (const char *)(cache->index + cache->count);
+	cache->strings_size = header->strings_size;
+
+	/* Every repository needs a url, and the index must stay in bounds. */
+	for (i = 0; i < cache->count; i++) {
+		if (!cache->records[i].url ||
+		    cache->records[i].url >= cache->strings_size ||
+		    cache->index[i].url >= cache->strings_size ||
+		    cache->index[i].record >= cache->count) {
+			free(cache);
+			goto invalid;
+		}
+	}
+	return cache;
+
+invalid:
+	munmap(map, size);
+	return NULL;
+}
+
+int repo_cache_count(const struct repo_cache *cache)
+{
+	return cache->count;
+}
+
+const struct repo_cache_record *repo_cache_record(const struct repo_cache *cache,
+						  int i)
+{
+	return &cache->records[i];
+}
+
+char *repo_cache_string(const struct repo_cache *cache, uint32_t offset)
+{
+	if (!offset || offset >= cache->strings_size)
+		return NULL;
+	return (char *)cache->strings + offset;
+}
+
+/* Return the first record with 'url', or -1. */
+int repo_cache_find(const struct repo_cache *cache, const char *url)
+{
+	int lo = 0, hi = cache->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(cache->strings + cache->index[mid].url, url) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < cache->count && !strcmp(cache->strings + cache->index[lo].url, url))
+		return cache->index[lo].record;
+	return -1;
+}
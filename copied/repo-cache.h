@@ -0,0 +1,63 @@
+#ifndef REPO_CACHE_H
+#define REPO_CACHE_H
+
+#include "cgit.h"
+
+/*
+ * Binary version of a cached repolist, written next to the text rc-* file.
+ * The file holds a header, one fixed size record per repository, an index
+ * of the records sorted by url and a string table. Strings are referred to
+ * by their offset in the string table, where 0 means NULL.
+ *
+ * Settings which only print_repo() knows how to encode (filters, snapshots,
+ * sorting...) are stored as name/value pairs and applied with repo_config().
+ */
+struct repo_cache_record {
+	uint32_t url;
+	uint32_t name;
+	uint32_t path;
+	uint32_t owner;
+	uint32_t desc;
+	uint32_t defbranch;
+	uint32_t module_link;
+	uint32_t section;
+	uint32_t clone_url;
+	uint32_t logo;
+	uint32_t logo_link;
+	uint32_t readme;	/* 'nreadme' strings, one after the other */
+	uint32_t nreadme;
+	uint32_t settings;	/* 'nsettings' name/value pairs */
+	uint32_t nsettings;
+	int32_t enable_commit_graph;
+	int32_t enable_log_filecount;
+	int32_t enable_log_linecount;
+	int32_t enable_remote_branches;
+	int32_t enable_subject_links;
+};
+
+struct repo_cache_writer {
+	struct strbuf records;
+	struct strbuf strings;
+	int count;
+};
+
+struct repo_cache;
+
+extern void repo_cache_writer_init(struct repo_cache_writer *w);
+extern uint32_t repo_cache_add_string(struct repo_cache_writer *w, const char *str);
+extern uint32_t repo_cache_add_strings(struct repo_cache_writer *w,
+				       const struct strbuf *buf);
+extern void repo_cache_add_record(struct repo_cache_writer *w,
+				  const struct repo_cache_record *rec);
+extern int repo_cache_commit(struct repo_cache_writer *w, const char *filename,
+			     uint64_t rc_size);
+extern void repo_cache_writer_release(struct repo_cache_writer *w);
+
+extern struct repo_cache *repo_cache_open(const char *filename, uint64_t rc_size);
+extern int repo_cache_count(const struct repo_cache *cache);
+extern const struct repo_cache_record *repo_cache_record(const struct repo_cache *cache,
+							 int i);
+extern char *repo_cache_string(const struct repo_cache *cache, uint32_t offset);
+extern int repo_cache_find(const struct repo_cache *cache, const char *url);
+
+#endif /* REPO_CACHE_H */
@@ -0,0 +1,166 @@
+/* repo-index.c: hashed lookup of repositories by url
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+#include "cgit.h"
+#include "cache.h"
+#include "repo-index.h"
+#include "repo-cache.h"
+
+/*
+ * Open addressing table with linear probing. Slots hold an index into
+ * cgit_repolist.repos (plus one, so zero marks an empty slot) since the
+ * repos array is moved around by xrealloc() as cgit_add_repo() appends.
+ *
+ * Repositories are indexed lazily: a lookup first catches up with whatever
+ * was appended since the last one. That way urls which are modified right
+ * after cgit_add_repo() (remove-suffix) are indexed in their final form.
+ *
+ * Repositories loaded from a binary cached repolist are not hashed at all,
+ * the sorted url index of the cache is searched instead.
+ */
+struct repo_slot {
+	unsigned long hash;
+	int repo;
+};
+
+static struct repo_slot *slots;
+static unsigned int slot_count;
+static int indexed;
+
+static const struct repo_cache *mapped;
+static int mapped_base, mapped_count;
+
+static int is_mapped(int idx)
+{
+	return mapped && idx >= mapped_base && idx < mapped_base + mapped_count;
+}
+
+static void insert_repo(int idx, unsigned long hash)
+{
+	unsigned int i = hash & (slot_count - 1);
+
+	while (slots[i].repo) {
+		/* The first repo with a given url wins, as in a linear scan. */
+		if (slots[i].hash == hash &&
+		    !strcmp(cgit_repolist.repos[slots[i].repo - 1].url,
+			    cgit_repolist.repos[idx].url))
+			return;
+		i = (i + 1) & (slot_count - 1);
+	}
+	slots[i].hash = hash;
+	slots[i].repo = idx + 1;
+}
+
+static void update_index(void)
+{
+	unsigned int size;
+	int i;
+
+	if (indexed > cgit_repolist.count)
+		cgit_repo_index_reset();
+	if (indexed == cgit_repolist.count)
+		return;
+
+	/* Keep the load factor below one half. */
+	size = slot_count ? slot_count : 64;
+	while (size < 2 * (unsigned int)(cgit_repolist.count -
+					 (mapped ? mapped_count : 0)))
+		size *= 2;
+	if (size != slot_count) {
+		free(slots);
+		slots = xcalloc(size, sizeof(*slots));
+		slot_count = size;
+		indexed = 0;
+	}
+	for (i = indexed; i < cgit_repolist.count; i++)
+		if (!is_mapped(i))
+			insert_repo(i, hash_str(cgit_repolist.repos[i].url));
+	indexed = cgit_repolist.count;
+}
+
+/* Must be called whenever repos already in cgit_repolist are removed,
+ * reordered or renamed.
+ */
+void cgit_repo_index_reset(void)
+{
+	if (slots)
+		memset(slots, 0, slot_count * sizeof(*slots));
+	indexed = 0;
+	mapped = NULL;
+}
+
+/* The repositories from 'base' on were just added from 'cache', in the
+ * order of its records. Only one cache is looked up this way, any further
+ * ones are hashed like all other repositories.
+ */
+void cgit_repo_index_map(const struct repo_cache *cache, int base)
+{
+	if (mapped || indexed > base ||
+	    base + repo_cache_count(cache) != cgit_repolist.count)
+		return;
+	mapped = cache;
+	mapped_base = base;
+	mapped_count = repo_cache_count(cache);
+}
+
+struct cgit_repo *cgit_lookup_repo(const char *url)
+{
+	unsigned long hash;
+	unsigned int i;
+	struct cgit_repo *repo, *found = NULL;
+	int idx;
+
+	update_index();
+	if (slot_count) {
+		hash = hash_str(url);
+		for (i = hash & (slot_count - 1); slots[i].repo;
+		     i = (i + 1) & (slot_count - 1)) {
+			if (slots[i].hash != hash)
+				continue;
+			repo = &cgit_repolist.repos[slots[i].repo - 1];
+			if (!strcmp(repo->url, url)) {
+				found = repo;
+				break;
+			}
+		}
+	}
+	if (mapped) {
+		idx = repo_cache_find(mapped, url);
+		if (idx >= 0 && (!found ||
+				 mapped_base + idx < found - cgit_repolist.repos))
+			found = &cgit_repolist.repos[mapped_base + idx];
+	}
+	return found;
+}
+
+/* The repository 'url' is about, the way cgit_parse_url() resolves it: the
+ * whole url, or else its shortest prefix ending before a '/' which is the
+ * url of a repository. Each candidate costs a single probe. '*len' is set
+ * to the length of the repository's part of 'url'.
+ */
+struct cgit_repo *cgit_lookup_url(const char *url, size_t *len)
+{
+	struct cgit_repo *repo;
+	char *buf, *p;
+
+	repo = cgit_lookup_repo(url);
+	if (repo) {
+		*len = strlen(url);
+		return repo;
+	}
+	buf = xstrdup(url);
+	for (p = strchr(buf, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		repo = cgit_lookup_repo(buf);
+		*p = '/';
+		if (repo) {
+			*len = p - buf;
+			break;
+		}
+	}
+	free(buf);
+	return repo;
+}
@@ -0,0 +1,13 @@
+#ifndef REPO_INDEX_H
+#define REPO_INDEX_H
+
+#include "cgit.h"
+
+extern struct cgit_repo *cgit_lookup_repo(const char *url);
+extern struct cgit_repo *cgit_lookup_url(const char *url, size_t *len);
+extern void cgit_repo_index_reset(void);
+
+struct repo_cache;
+extern void cgit_repo_index_map(const struct repo_cache *cache, int base);
+
+#endif /* REPO_INDEX_H */
@@ -0,0 +1,221 @@
+/* repo-probe.c: stat the files of a repository found below scan-path
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+#include "cgit.h"
+#include "repo-probe.h"
+#ifdef USE_IO_URING
+#include <liburing.h>
+#endif
+
+static const char *probe_name(int i)
+{
+	switch (i) {
+	case PROBE_OBJECTS:
+		return "objects";
+	case PROBE_HEAD:
+		return "HEAD";
+	case PROBE_STRICT_EXPORT:
+		return ctx.cfg.strict_export;
+	case PROBE_NOWEB:
+		return "noweb";
+	case PROBE_CONFIG:
+		return "config";
+	case PROBE_DESCRIPTION:
+		return "description";
+	case PROBE_CGITRC:
+		return "cgitrc";
+	}
+	return NULL;
+}
+
+static void probe_paths(struct strbuf *paths, const char *gitdir)
+{
+	const char *name;
+	int i;
+
+	for (i = 0; i < PROBE_MAX; i++) {
+		strbuf_init(&paths[i], 0);
+		strbuf_addstr(&paths[i], gitdir);
+		if ((name = probe_name(i)))
+			strbuf_addf(&paths[i], "/%s", name);
+	}
+}
+
+/* Like is_git_dir(): objects/ must be a directory and HEAD a file. */
+static int probed_git_dir(const char *path, struct repo_probe *probe)
+{
+	int i;
+
+	for (i = PROBE_OBJECTS; i <= PROBE_HEAD; i++)
+		if (probe->err[i] && probe->err[i] != ENOENT)
+			fprintf(stderr, "Error checking path %s/%s: %s (%d)\n",
+				path, probe_name(i), strerror(probe->err[i]),
+				probe->err[i]);
+	return !probe->err[PROBE_OBJECTS] &&
+		S_ISDIR(probe->st[PROBE_OBJECTS].st_mode) &&
+		!probe->err[PROBE_HEAD] &&
+		S_ISREG(probe->st[PROBE_HEAD].st_mode);
+}
+
+#ifdef USE_IO_URING
+/*
+ * With io_uring the statx() calls of a repository are submitted in two
+ * batches, the directory, objects/ and HEAD first and the rest only if that
+ * found a repository, which saves most of the round trips on network
+ * filesystems. A kernel
+ * without io_uring (or a seccomp filter denying it) makes repo_prober_new()
+ * return NULL and the plain fstatat() version is used.
+ */
+struct repo_prober {
+	struct io_uring ring;
+	int broken;	/* the ring failed, only fstatat() is used */
+	struct statx stx[PROBE_MAX];
+};
+
+struct repo_prober *repo_prober_new(void)
+{
+	struct repo_prober *prober = xcalloc(1, sizeof(*prober));
+
+	if (io_uring_queue_init(PROBE_MAX, &prober->ring, 0)) {
+		free(prober);
+		return NULL;
+	}
+	return prober;
+}
+
+void repo_prober_free(struct repo_prober *prober)
+{
+	if (!prober)
+		return;
+	io_uring_queue_exit(&prober->ring);
+	free(prober);
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_mode = stx->stx_mode;
+	st->st_uid = stx->stx_uid;
+	st->st_size = stx->stx_size;
+	st->st_mtime = stx->stx_mtime.tv_sec;
+}
+
+/* Stat the files 'first' to 'last' in one go. If the ring fails, the
+ * completions of what was submitted are still reaped, so none of them turn
+ * up in a later probe, and the ring isn't used again: anything it failed to
+ * submit is still queued in it.
+ */
+static int probe_ring(struct repo_prober *prober, int dirfd,
+		      struct strbuf *paths, struct repo_probe *probe,
+		      int first, int last)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int i, ret, n = 0, submitted = 0, done = 0;
+
+	for (i = first; i <= last; i++) {
+		probe->err[i] = ENOENT;
+		if (i == PROBE_STRICT_EXPORT && !ctx.cfg.strict_export)
+			continue;
+		sqe = io_uring_get_sqe(&prober->ring);
+		io_uring_prep_statx(sqe, dirfd, paths[i].buf, 0,
+				    STATX_TYPE | STATX_MODE | STATX_UID |
+				    STATX_SIZE | STATX_MTIME, &prober->stx[i]);
+		io_uring_sqe_set_data(sqe, (void *)(intptr_t)i);
+		n++;
+	}
+	while (submitted < n) {
+		ret = io_uring_submit(&prober->ring);
+		if (ret <= 0)
+			break;
+		submitted += ret;
+	}
+	while (done < submitted) {
+		ret = io_uring_wait_cqe(&prober->ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret)
+			break;
+		i = (intptr_t)io_uring_cqe_get_data(cqe);
+		if (cqe->res < 0)
+			probe->err[i] = -cqe->res;
+		else {
+			probe->err[i] = 0;
+			statx_to_stat(&prober->stx[i], &probe->st[i]);
+		}
+		io_uring_cqe_seen(&prober->ring, cqe);
+		done++;
+	}
+	if (done < n) {
+		fprintf(stderr, "[cgit] Error probing %s with io_uring, "
+			"falling back to stat\n", paths[first].buf);
+		prober->broken = 1;
+		return -1;
+	}
+	return 0;
+}
+#else
+struct repo_prober *repo_prober_new(void)
+{
+	return NULL;
+}
+
+void repo_prober_free(struct repo_prober *prober)
+{
+}
+#endif
+
+static void probe_stat(int dirfd, struct strbuf *paths, struct repo_probe *probe,
+		       int first, int last)
+{
+	int i;
+
+	for (i = first; i <= last; i++) {
+		probe->err[i] = ENOENT;
+		if (i == PROBE_STRICT_EXPORT && !ctx.cfg.strict_export)
+			continue;
+		probe->err[i] = fstatat(dirfd, paths[i].buf, &probe->st[i], 0) ?
+			errno : 0;
+	}
+}
+
+/* Stat the files of the repository 'gitdir' ("." or ".git") relative to the
+ * directory 'dirfd'. 'path' is the full path of 'gitdir', for messages.
+ * Returns 1 if it is a repository.
+ */
+int repo_probe(struct repo_prober *prober, int dirfd, const char *path,
+	       const char *gitdir, struct repo_probe *probe)
+{
+	struct strbuf paths[PROBE_MAX];
+	int i, result;
+
+	probe_paths(paths, gitdir);
+	/* Either way, don't stat the rest of something that isn't a
+	 * repository at all.
+	 */
+#ifdef USE_IO_URING
+	if (prober && !prober->broken &&
+	    !probe_ring(prober, dirfd, paths, probe, PROBE_DIR, PROBE_HEAD)) {
+		result = probed_git_dir(path, probe);
+		if (result && probe_ring(prober, dirfd, paths, probe,
+					 PROBE_STRICT_EXPORT, PROBE_MAX - 1))
+			probe_stat(dirfd, paths, probe, PROBE_STRICT_EXPORT,
+				   PROBE_MAX - 1);
+	} else
+#endif
+	{
+		probe_stat(dirfd, paths, probe, PROBE_OBJECTS, PROBE_HEAD);
+		result = probed_git_dir(path, probe);
+		if (result) {
+			probe_stat(dirfd, paths, probe, PROBE_DIR, PROBE_DIR);
+			probe_stat(dirfd, paths, probe, PROBE_STRICT_EXPORT,
+				   PROBE_MAX - 1);
+		}
+	}
+	for (i = 0; i < PROBE_MAX; i++)
+		strbuf_release(&paths[i]);
+	return result;
+}
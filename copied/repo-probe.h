@@ -0,0 +1,33 @@
+#ifndef REPO_PROBE_H
+#define REPO_PROBE_H
+
+/*
+ * The files scan-path looks at in every repository, stat'ed relative to an
+ * open directory in one go instead of one path lookup at a time.
+ */
+enum repo_probe_file {
+	PROBE_DIR,
+	PROBE_OBJECTS,
+	PROBE_HEAD,
+	PROBE_STRICT_EXPORT,
+	PROBE_NOWEB,
+	PROBE_CONFIG,
+	PROBE_DESCRIPTION,
+	PROBE_CGITRC,
+	PROBE_MAX
+};
+
+struct repo_probe {
+	struct stat st[PROBE_MAX];
+	int err[PROBE_MAX];	/* errno of the stat, 0 if it succeeded */
+};
+
+/* Per thread state of the prober, NULL uses plain fstatat(). */
+struct repo_prober;
+
+extern struct repo_prober *repo_prober_new(void);
+extern void repo_prober_free(struct repo_prober *prober);
+extern int repo_probe(struct repo_prober *prober, int dirfd, const char *path,
+		      const char *gitdir, struct repo_probe *probe);
+
+#endif /* REPO_PROBE_H */
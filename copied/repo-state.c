@@ -0,0 +1,154 @@
+/* repo-state.c: cheap digest of the refs of a repository
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+#include "cgit.h"
+#include "repo-state.h"
+
+/*
+ * Refs are updated by writing a lockfile and renaming it into place, and
+ * packed-refs is rewritten the same way. The inode, size and mtime of every
+ * ref file therefore change whenever a ref does, and hashing those is as
+ * good as hashing the refs themselves without reading any of them. Only
+ * HEAD is read, since a symref can be changed in place.
+ */
+
+static void add_stat(git_SHA_CTX *c, struct repo_state *state,
+		     const char *name, const struct stat *st)
+{
+	uint64_t data[4];
+
+	data[0] = st->st_ino;
+	data[1] = st->st_size;
+	data[2] = st->st_mtime;
+	data[3] = ST_MTIME_NSEC(*st);
+	git_SHA1_Update(c, name, strlen(name) + 1);
+	git_SHA1_Update(c, data, sizeof(data));
+	if (st->st_mtime > state->modified)
+		state->modified = st->st_mtime;
+}
+
+static void add_file(git_SHA_CTX *c, struct repo_state *state, int dirfd,
+		     const char *name)
+{
+	struct stat st;
+
+	if (fstatat(dirfd, name, &st, 0))
+		git_SHA1_Update(c, name, strlen(name) + 1);
+	else
+		add_stat(c, state, name, &st);
+}
+
+/* Namespaces Gerrit updates on every upload, review or comment. No page
+ * shows them (the ref decorations of a log aside), and walking them would
+ * mean reading every change's directory and throwing away every cached
+ * page whenever a change is touched.
+ */
+static const char *skipped_refs[] = {
+	"refs/cache-automerge",
+	"refs/changes",
+	"refs/draft-comments",
+	"refs/meta",
+	"refs/sequences",
+	"refs/starred-changes",
+	NULL
+};
+
+static int skip_refs(const char *path)
+{
+	const char **ref;
+
+	for (ref = skipped_refs; *ref; ref++)
+		if (!strcmp(path, *ref))
+			return 1;
+	return 0;
+}
+
+/* Walk the loose refs below 'path' (relative to 'dirfd'). Entries are hashed
+ * in sorted order, readdir() doesn't promise any.
+ */
+static void add_refs(git_SHA_CTX *c, struct repo_state *state, int dirfd,
+		     struct strbuf *path)
+{
+	struct string_list entries = STRING_LIST_INIT_DUP;
+	struct string_list_item *item;
+	struct dirent *ent;
+	struct stat st;
+	size_t len = path->len;
+	DIR *dir;
+	int fd;
+
+	fd = openat(dirfd, path->buf, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return;
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return;
+	}
+	/* A deleted loose ref leaves its directory's mtime behind. */
+	if (!fstat(fd, &st) && st.st_mtime > state->modified)
+		state->modified = st.st_mtime;
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		string_list_append(&entries, ent->d_name);
+	}
+	sort_string_list(&entries);
+	for_each_string_list_item(item, &entries) {
+		if (fstatat(fd, item->string, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		strbuf_setlen(path, len);
+		strbuf_addf(path, "/%s", item->string);
+		if (S_ISDIR(st.st_mode)) {
+			if (!skip_refs(path->buf))
+				add_refs(c, state, dirfd, path);
+		}
+		else
+			add_stat(c, state, path->buf, &st);
+	}
+	strbuf_setlen(path, len);
+	closedir(dir);
+	string_list_clear(&entries, 0);
+}
+
+/* Fill 'state' for the repository at 'path'. Returns 0 on success. */
+int repo_state(const char *path, struct repo_state *state)
+{
+	static const char *files[] = {
+		"packed-refs", "config", "description", "cgitrc", NULL
+	};
+	struct strbuf refs = STRBUF_INIT;
+	const char **file;
+	git_SHA_CTX c;
+	struct stat st;
+	char head[256];
+	ssize_t len;
+	int dirfd, fd;
+
+	memset(state, 0, sizeof(*state));
+	dirfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0)
+		return -1;
+
+	git_SHA1_Init(&c);
+	fd = openat(dirfd, "HEAD", O_RDONLY);
+	if (fd >= 0) {
+		len = read_in_full(fd, head, sizeof(head));
+		if (len > 0)
+			git_SHA1_Update(&c, head, len);
+		if (!fstat(fd, &st))
+			add_stat(&c, state, "HEAD", &st);
+		close(fd);
+	}
+	for (file = files; *file; file++)
+		add_file(&c, state, dirfd, *file);
+	strbuf_addstr(&refs, "refs");
+	add_refs(&c, state, dirfd, &refs);
+	strbuf_release(&refs);
+	close(dirfd);
+	git_SHA1_Final(state->sha1, &c);
+	return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef REPO_STATE_H
+#define REPO_STATE_H
+
+#include "cgit.h"
+
+/*
+ * What a page about a repository depends on besides the objects it names:
+ * HEAD, the refs (except Gerrit's review namespaces such as refs/changes)
+ * and the repository's settings. It is taken from the files
+ * alone (no object or ref parsing), so it is cheap enough to check before
+ * anything is rendered.
+ */
+struct repo_state {
+	unsigned char sha1[20];	/* digest of the files and their stat data */
+	time_t modified;	/* newest change among them */
+};
+
+extern int repo_state(const char *path, struct repo_state *state);
+
+#endif /* REPO_STATE_H */
@@ -11,12 +11,19 @@
 #include "scan-tree.h"
 #include "configfile.h"
 #include "html.h"
+#include "repo-probe.h"
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 
 /* CHERRY */
 #include "gerrit_curl.h" 
-#include <jansson.h>
+#include "repo-index.h"
 /* //CHERRY */
-/* return 1 if path contains a objects/ directory and a HEAD file */
+#ifndef NO_INOTIFY
+/* return 1 if path contains a objects/ directory and a HEAD file
+ * (scanning uses repo_probe() instead, only the watcher needs this)
+ */
 static int is_git_dir(const char *path)
 {
 	struct stat st;
@@ -49,6 +56,71 @@ out:
 	strbuf_release(&pathbuf);
 	return result;
 }
+#endif
+
+/*
+ * Parallel scanning (scan-threads). Every worker keeps a stack of the
+ * directories it still has to scan: it takes the newest one itself, idle
+ * workers steal the oldest one, which tends to hold the biggest part of the
+ * tree. Repositories are collected per worker and added to cgit_repolist
+ * once all are done. Reading git config, cgitrc and passwd isn't reentrant,
+ * so that and the incremental index are serialized by scan_lock.
+ *
+ * Functions taking a 'struct scan_worker' scan serially if it is NULL.
+ */
+struct scan_worker {
+	char **dirs;
+	int head, nr, alloc;
+	struct cgit_repo *repos;
+	int repos_nr, repos_alloc;
+	struct repo_prober *prober;
+#ifndef NO_PTHREADS
+	pthread_t thread;
+	int started;
+	pthread_mutex_t lock;
+#endif
+};
+
+#ifndef NO_PTHREADS
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_scan(w) do { if (w) pthread_mutex_lock(&scan_lock); } while (0)
+#define unlock_scan(w) do { if (w) pthread_mutex_unlock(&scan_lock); } while (0)
+#else
+#define lock_scan(w) do { } while (0)
+#define unlock_scan(w) do { } while (0)
+#endif
+
+static struct scan_worker *workers;
+
+/* The prober of a serial scan. */
+static struct repo_prober *serial_prober;
+
+static struct repo_prober *prober_of(struct scan_worker *w)
+{
+	return w ? w->prober : serial_prober;
+}
+
+/* The defaults of cgit_add_repo(), for repositories added by workers. */
+static struct cgit_repo repo_template;
+
+static struct cgit_repo *new_repo(struct scan_worker *w, const char *url)
+{
+	struct cgit_repo *r;
+
+	if (!w)
+		return cgit_add_repo(url);
+	ALLOC_GROW(w->repos, w->repos_nr + 1, w->repos_alloc);
+	r = &w->repos[w->repos_nr++];
+	*r = repo_template;
+	r->url = trim_end(url, '/');
+	r->name = r->url;
+	return r;
+}
+
+static int repo_count(struct scan_worker *w)
+{
+	return w ? w->repos_nr : cgit_repolist.count;
+}
 
 struct cgit_repo *repo;
 repo_config_fn config_fn;
@@ -72,6 +144,41 @@ static int gitconfig_config(const char *key, const char *value, void *cb)
 	return 0;
 }
 
+/*
+ * Incremental scanning.
+ *
+ * The index of the previous scan holds the mtime and the subdirectories of
+ * every directory it walked. For every repository it holds a signature of
+ * the files its settings come from (config, description, cgitrc, noweb and
+ * strict-export), and the settings as print_repo() wrote them to the cached
+ * repolist.
+ *
+ * A directory whose mtime is unchanged still has the same entries, so its
+ * known subdirectories are walked without reading it. A repository whose
+ * signature is unchanged has its settings replayed instead of reading its
+ * git config, cgitrc and owner again. Since mtimes don't propagate upwards
+ * every known directory is still stat()ed once.
+ */
+struct scan_dir {
+	time_t mtime;
+	struct string_list subdirs;
+};
+
+struct scan_repo {
+	char *sig;
+	char *settings;		/* of the previous scan */
+	int idx;		/* in cgit_repolist, -1 if hidden */
+	int worker;		/* whose repos 'idx' is in until merged */
+};
+
+static int incremental;
+static time_t scan_started;
+static char *index_fingerprint;
+static struct string_list old_dirs = STRING_LIST_INIT_DUP;
+static struct string_list old_repos = STRING_LIST_INIT_DUP;
+static struct string_list new_dirs = STRING_LIST_INIT_DUP;
+static struct string_list new_repos = STRING_LIST_INIT_DUP;
+
 static char *xstrrchr(char *s, char *from, int c)
 {
 	while (from >= s && *from != c)
@@ -79,37 +186,43 @@ static char *xstrrchr(char *s, char *from, int c)
 	return from < s ? NULL : from;
 }
 
-static void add_repo(const char *base, struct strbuf *path, repo_config_fn fn)
+/*
+ * What add_repo() needs to read the settings of a repository later: its git
+ * config, owner, description and cgitrc are only read by scan_tree_load(),
+ * for the repository a request is about or when all of them are listed.
+ */
+struct repo_meta {
+	repo_config_fn fn;
+	char *rel;		/* path below scan-path, for section-from-path */
+	uid_t uid;
+	unsigned int config:1;
+	unsigned int description:1;
+	unsigned int cgitrc:1;
+};
+
+static void add_repo(struct scan_worker *w, const char *base, struct strbuf *path,
+		     const struct repo_probe *probe, repo_config_fn fn)
 {
 	//here
-	struct stat st;
-	struct passwd *pwd;
-	size_t pathlen;
+	struct cgit_repo *r;
+	struct repo_meta *meta;
 	struct strbuf rel = STRBUF_INIT;
-	char *p, *slash;
-	int n;
-	size_t size;
+	char *p;
 
-	if (stat(path->buf, &st)) {
+	if (probe->err[PROBE_DIR]) {
 		fprintf(stderr, "Error accessing %s: %s (%d)\n",
-			path->buf, strerror(errno), errno);
+			path->buf, strerror(probe->err[PROBE_DIR]),
+			probe->err[PROBE_DIR]);
 		return;
 	}
 
 	strbuf_addch(path, '/');
-	pathlen = path->len;
 
-	if (ctx.cfg.strict_export) {
-		strbuf_addstr(path, ctx.cfg.strict_export);
-		if(stat(path->buf, &st))
-			return;
-		strbuf_setlen(path, pathlen);
-	}
+	if (ctx.cfg.strict_export && probe->err[PROBE_STRICT_EXPORT])
+		return;
 
-	strbuf_addstr(path, "noweb");
-	if (!stat(path->buf, &st))
+	if (!probe->err[PROBE_NOWEB])
 		return;
-	strbuf_setlen(path, pathlen);
 
 	if (strncmp(base, path->buf, strlen(base)))
 		strbuf_addbuf(&rel, path);
@@ -121,91 +234,326 @@ static void add_repo(const char *base, struct strbuf *path, repo_config_fn fn)
 	else if (rel.len && rel.buf[rel.len - 1] == '/')
 		strbuf_setlen(&rel, rel.len - 1);
 
-	repo = cgit_add_repo(rel.buf);
-	config_fn = fn;
-	if (ctx.cfg.enable_git_config) {
-		strbuf_addstr(path, "config");
-		git_config_from_file(gitconfig_config, path->buf, NULL);
-		strbuf_setlen(path, pathlen);
-	}
-
+	r = new_repo(w, rel.buf);
 	if (ctx.cfg.remove_suffix)
-		if ((p = strrchr(repo->url, '.')) && !strcmp(p, ".git"))
+		if ((p = strrchr(r->url, '.')) && !strcmp(p, ".git"))
 			*p = '\0';
-	repo->path = xstrdup(path->buf);
-	while (!repo->owner) {
-		if ((pwd = getpwuid(st.st_uid)) == NULL) {
-			fprintf(stderr, "Error reading owner-info for %s: %s (%d)\n",
-				path->buf, strerror(errno), errno);
-			break;
-		}
-		if (pwd->pw_gecos)
-			if ((p = strchr(pwd->pw_gecos, ',')))
-				*p = '\0';
-		repo->owner = xstrdup(pwd->pw_gecos ? pwd->pw_gecos : pwd->pw_name);
+	r->path = xstrdup(path->buf);
+
+	meta = xcalloc(1, sizeof(*meta));
+	meta->fn = fn;
+	meta->rel = strbuf_detach(&rel, NULL);
+	meta->uid = probe->st[PROBE_DIR].st_uid;
+	meta->config = !probe->err[PROBE_CONFIG];
+	meta->description = !probe->err[PROBE_DESCRIPTION];
+	meta->cgitrc = !probe->err[PROBE_CGITRC];
+	r->meta = meta;
+}
+
+/* Thousands of repositories usually belong to a handful of users. */
+struct owner {
+	uid_t uid;
+	char *name;	/* NULL if the uid is unknown */
+};
+
+static struct owner *owners;
+static int owners_nr, owners_alloc;
+
+static char *owner_name(uid_t uid, const char *path)
+{
+	struct passwd *pwd;
+	struct owner *o;
+	char *p;
+	int i;
+
+	for (i = 0; i < owners_nr; i++)
+		if (owners[i].uid == uid)
+			return owners[i].name;
+
+	ALLOC_GROW(owners, owners_nr + 1, owners_alloc);
+	o = &owners[owners_nr++];
+	o->uid = uid;
+	o->name = NULL;
+	if ((pwd = getpwuid(uid)) == NULL) {
+		fprintf(stderr, "Error reading owner-info for %s: %s (%d)\n",
+			path, strerror(errno), errno);
+		return NULL;
 	}
+	if (pwd->pw_gecos)
+		if ((p = strchr(pwd->pw_gecos, ',')))
+			*p = '\0';
+	o->name = xstrdup(pwd->pw_gecos ? pwd->pw_gecos : pwd->pw_name);
+	return o->name;
+}
 
-	if (repo->desc == cgit_default_repo_desc || !repo->desc) {
-		strbuf_addstr(path, "description");
-		if (!stat(path->buf, &st))
-			readfile(path->buf, &repo->desc, &size);
-		strbuf_setlen(path, pathlen);
+/* Read the settings add_repo() left out, in the order it used to. */
+void scan_tree_load(struct cgit_repo *r)
+{
+	struct repo_meta *meta = r->meta;
+	struct strbuf path = STRBUF_INIT;
+	char *rel, *slash;
+	size_t pathlen, size;
+	int n;
+
+	if (!meta)
+		return;
+	r->meta = NULL;
+	rel = meta->rel;
+	strbuf_addstr(&path, r->path);
+	pathlen = path.len;
+
+	if (ctx.cfg.enable_git_config && meta->config) {
+		strbuf_addstr(&path, "config");
+		repo = r;
+		config_fn = meta->fn;
+		git_config_from_file(gitconfig_config, path.buf, NULL);
+		strbuf_setlen(&path, pathlen);
+	}
+
+	if (!r->owner)
+		r->owner = owner_name(meta->uid, path.buf);
+
+	if (r->desc == cgit_default_repo_desc || !r->desc) {
+		strbuf_addstr(&path, "description");
+		if (meta->description)
+			readfile(path.buf, &r->desc, &size);
+		strbuf_setlen(&path, pathlen);
 	}
 
 	if (ctx.cfg.section_from_path) {
 		n  = ctx.cfg.section_from_path;
 		if (n > 0) {
-			slash = rel.buf;
+			slash = rel;
 			while (slash && n && (slash = strchr(slash, '/')))
 				n--;
 		} else {
-			slash = rel.buf + rel.len;
-			while (slash && n && (slash = xstrrchr(rel.buf, slash, '/')))
+			slash = rel + strlen(rel);
+			while (slash && n && (slash = xstrrchr(rel, slash, '/')))
 				n++;
 		}
 		if (slash && !n) {
 			*slash = '\0';
-			repo->section = xstrdup(rel.buf);
+			r->section = xstrdup(rel);
 			*slash = '/';
-			if (!prefixcmp(repo->name, repo->section)) {
-				repo->name += strlen(repo->section);
-				if (*repo->name == '/')
-					repo->name++;
+			if (!prefixcmp(r->name, r->section)) {
+				r->name += strlen(r->section);
+				if (*r->name == '/')
+					r->name++;
 			}
 		}
 	}
 
-	strbuf_addstr(path, "cgitrc");
-	if (!stat(path->buf, &st))
-		parse_configfile(xstrdup(path->buf), &repo_config);
+	if (meta->cgitrc) {
+		strbuf_addstr(&path, "cgitrc");
+		repo = r;
+		config_fn = meta->fn;
+		parse_configfile(strbuf_detach(&path, NULL), &repo_config);
+	}
+
+	strbuf_release(&path);
+	free(meta->rel);
+	free(meta);
+}
+
+void scan_tree_load_all(void)
+{
+	int i;
+
+	for (i = 0; i < cgit_repolist.count; i++)
+		scan_tree_load(&cgit_repolist.repos[i]);
+}
+
+static void add_file_sig(struct strbuf *sig, const struct repo_probe *probe,
+			 int file)
+{
+	const struct stat *st = &probe->st[file];
+
+	if (probe->err[file])
+		strbuf_addstr(sig, " -");
+	else if (st->st_mtime >= scan_started)
+		strbuf_addstr(sig, " racy");
+	else
+		strbuf_addf(sig, " %lu.%lu", (unsigned long)st->st_mtime,
+			    (unsigned long)st->st_size);
+}
+
+static void repo_sig(struct strbuf *sig, const struct repo_probe *probe)
+{
+	strbuf_reset(sig);
+	if (probe->err[PROBE_DIR])
+		strbuf_addstr(sig, "-");
+	else
+		strbuf_addf(sig, "%lu", (unsigned long)probe->st[PROBE_DIR].st_uid);
+	if (ctx.cfg.strict_export)
+		add_file_sig(sig, probe, PROBE_STRICT_EXPORT);
+	add_file_sig(sig, probe, PROBE_NOWEB);
+	add_file_sig(sig, probe, PROBE_CONFIG);
+	add_file_sig(sig, probe, PROBE_DESCRIPTION);
+	add_file_sig(sig, probe, PROBE_CGITRC);
+}
+
+static void record_repo(struct scan_worker *w, const char *path, const char *sig,
+			int idx)
+{
+	struct scan_repo *r = xcalloc(1, sizeof(*r));
+
+	/* A file changed in the second we scanned it may change again
+	 * without its mtime telling, so such a signature never matches.
+	 */
+	r->sig = xstrdup(strstr(sig, " racy") ? "" : sig);
+	r->idx = idx < repo_count(w) ? idx : -1;
+	r->worker = w ? w - workers : -1;
+	lock_scan(w);
+	string_list_append(&new_repos, path)->util = r;
+	unlock_scan(w);
+}
+
+static struct scan_dir *record_dir(struct scan_worker *w, const char *path,
+				   time_t mtime)
+{
+	struct scan_dir *d = xcalloc(1, sizeof(*d));
+
+	d->mtime = mtime < scan_started ? mtime : -1;
+	d->subdirs.strdup_strings = 1;
+	lock_scan(w);
+	string_list_append(&new_dirs, path)->util = d;
+	unlock_scan(w);
+	return d;
+}
+
+/* Add a repository from the settings print_repo() wrote for it, the same way
+ * config_cb() does when reading them from the cached repolist.
+ */
+static void replay_repo(struct scan_worker *w, const char *settings,
+			repo_config_fn fn)
+{
+	struct strbuf line = STRBUF_INIT;
+	struct cgit_repo *r = NULL;
+	const char *p, *eol;
+	char *value;
+
+	lock_scan(w);
+	for (p = settings; *p; p = *eol ? eol + 1 : eol) {
+		eol = strchrnul(p, '\n');
+		strbuf_reset(&line);
+		strbuf_add(&line, p, eol - p);
+		value = strchr(line.buf, '=');
+		if (!value || prefixcmp(line.buf, "repo."))
+			continue;
+		*value++ = '\0';
+		if (!strcmp(line.buf, "repo.url"))
+			r = new_repo(w, value);
+		else if (!r)
+			continue;
+		else if (!strcmp(line.buf, "repo.path"))
+			r->path = trim_end(value, '/');
+		else
+			fn(r, line.buf + 5, value);
+	}
+	unlock_scan(w);
+	strbuf_release(&line);
+}
+
+static void scan_path(struct scan_worker *w, const char *base, const char *path,
+		      repo_config_fn fn);
+static void push_dir(struct scan_worker *w, const char *path);
 
-	strbuf_release(&rel);
+static void scan_subdir(struct scan_worker *w, const char *base, const char *path,
+			repo_config_fn fn)
+{
+	if (w)
+		push_dir(w, path);
+	else
+		scan_path(NULL, base, path, fn);
 }
 
-static void scan_path(const char *base, const char *path, repo_config_fn fn)
+/* Reuse what the previous scan found in 'path' if nothing changed there.
+ * Returns 0 if 'path' has to be scanned.
+ */
+static int scan_known_path(struct scan_worker *w, const char *base,
+			   const char *path, repo_config_fn fn)
 {
-	DIR *dir = opendir(path);
+	struct string_list_item *item;
+	struct strbuf sub = STRBUF_INIT;
+	struct strbuf sig = STRBUF_INIT;
+	struct scan_repo *r;
+	struct scan_dir *d, *nd;
+	struct repo_probe probe;
+	struct stat st;
+	int idx, result = 0;
+
+	if ((item = string_list_lookup(&old_repos, path))) {
+		r = item->util;
+		strbuf_addstr(&sub, path);
+		if (!repo_probe(prober_of(w), AT_FDCWD, sub.buf, sub.buf, &probe)) {
+			strbuf_addstr(&sub, "/.git");
+			if (!repo_probe(prober_of(w), AT_FDCWD, sub.buf, sub.buf,
+					&probe))
+				goto out;
+		}
+		repo_sig(&sig, &probe);
+		if (strcmp(sig.buf, r->sig))
+			goto out;
+		idx = repo_count(w);
+		replay_repo(w, r->settings, fn);
+		record_repo(w, path, sig.buf, idx);
+		result = 1;
+	} else if ((item = string_list_lookup(&old_dirs, path))) {
+		d = item->util;
+		if (stat(path, &st) || d->mtime < 0 || st.st_mtime != d->mtime)
+			goto out;
+		nd = record_dir(w, path, d->mtime);
+		for_each_string_list_item(item, &d->subdirs) {
+			string_list_append(&nd->subdirs, item->string);
+			strbuf_reset(&sub);
+			strbuf_addf(&sub, "%s/%s", path, item->string);
+			scan_subdir(w, base, sub.buf, fn);
+		}
+		result = 1;
+	}
+out:
+	strbuf_release(&sub);
+	strbuf_release(&sig);
+	return result;
+}
+
+static void scan_path(struct scan_worker *w, const char *base, const char *path,
+		      repo_config_fn fn)
+{
+	DIR *dir;
 	struct dirent *ent;
 	struct strbuf pathbuf = STRBUF_INIT;
+	struct strbuf sig = STRBUF_INIT;
+	struct repo_probe probe;
 	size_t pathlen = strlen(path);
+	struct scan_dir *scanned = NULL;
 	struct stat st;
+	int fd, type, idx, known = 0;
+
+	if (incremental && scan_known_path(w, base, path, fn))
+		return;
 
+	dir = opendir(path);
 	if (!dir) {
 		fprintf(stderr, "Error opening directory %s: %s (%d)\n",
 			path, strerror(errno), errno);
 		return;
 	}
+	/* Everything below is looked up relative to the open directory. */
+	fd = dirfd(dir);
+
+	/* Taken before reading, a change while we do gets noticed next time. */
+	if (incremental && !fstat(fd, &st))
+		known = 1;
 
 	strbuf_add(&pathbuf, path, strlen(path));
-	if (is_git_dir(pathbuf.buf)) {
-		add_repo(base, &pathbuf, fn);
-		goto end;
-	}
+	if (repo_probe(prober_of(w), fd, pathbuf.buf, ".", &probe))
+		goto repo;
 	strbuf_addstr(&pathbuf, "/.git");
-	if (is_git_dir(pathbuf.buf)) {
-		add_repo(base, &pathbuf, fn);
-		goto end;
-	}
+	if (repo_probe(prober_of(w), fd, pathbuf.buf, ".git", &probe))
+		goto repo;
+	if (known)
+		scanned = record_dir(w, path, st.st_mtime);
 	/*
 	 * Add one because we don't want to lose the trailing '/' when we
 	 * reset the length of pathbuf in the loop below.
@@ -222,24 +570,559 @@ static void scan_path(const char *base, const char *path, repo_config_fn fn)
 		}
 		strbuf_setlen(&pathbuf, pathlen);
 		strbuf_addstr(&pathbuf, ent->d_name);
-		if (stat(pathbuf.buf, &st)) {
-			fprintf(stderr, "Error checking path %s: %s (%d)\n",
-				pathbuf.buf, strerror(errno), errno);
-			continue;
+		/* Most filesystems tell the type, symlinks need a stat. */
+		type = DTYPE(ent);
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			if (fstatat(fd, ent->d_name, &st, 0)) {
+				fprintf(stderr, "Error checking path %s: %s (%d)\n",
+					pathbuf.buf, strerror(errno), errno);
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		}
+		if (type == DT_DIR) {
+			if (scanned)
+				string_list_append(&scanned->subdirs, ent->d_name);
+			scan_subdir(w, base, pathbuf.buf, fn);
 		}
-		if (S_ISDIR(st.st_mode))
-			scan_path(base, pathbuf.buf, fn);
 	}
+	goto end;
+repo:
+	if (incremental)
+		repo_sig(&sig, &probe);
+	idx = repo_count(w);
+	add_repo(w, base, &pathbuf, &probe, fn);
+	if (incremental)
+		record_repo(w, path, sig.buf, idx);
 end:
 	strbuf_release(&pathbuf);
+	strbuf_release(&sig);
+	closedir(dir);
+}
+
+static void free_scan_index(struct string_list *dirs, struct string_list *repos)
+{
+	struct string_list_item *item;
+	struct scan_dir *d;
+	struct scan_repo *r;
+
+	for_each_string_list_item(item, dirs) {
+		d = item->util;
+		string_list_clear(&d->subdirs, 0);
+	}
+	string_list_clear(dirs, 1);
+	for_each_string_list_item(item, repos) {
+		r = item->util;
+		free(r->sig);
+		free(r->settings);
+	}
+	string_list_clear(repos, 1);
+}
+
+/* The global settings which change what a scan finds or what print_repo()
+ * writes for it. An index made with different ones is not used.
+ */
+static char *scan_fingerprint(void)
+{
+	return xstrdup(fmt("%d %d %d %d %s %d %d %d",
+			   ctx.cfg.enable_git_config, ctx.cfg.remove_suffix,
+			   ctx.cfg.section_from_path, ctx.cfg.scan_hidden_path,
+			   ctx.cfg.strict_export ? ctx.cfg.strict_export : "-",
+			   ctx.cfg.snapshots, ctx.cfg.max_stats,
+			   ctx.cfg.enable_filter_overrides));
+}
+
+/* Make the following scans incremental, using the index in 'filename' if it
+ * exists and was made with the current settings.
+ */
+void scan_tree_begin(const char *filename)
+{
+	struct strbuf line = STRBUF_INIT;
+	struct strbuf settings = STRBUF_INIT;
+	struct scan_dir *d = NULL;
+	struct scan_repo *r = NULL;
+	unsigned long mtime;
+	int pos;
+	FILE *f;
+
+	incremental = 1;
+	scan_started = time(NULL);
+	index_fingerprint = scan_fingerprint();
+	f = fopen(filename, "r");
+	if (!f)
+		return;
+	if (strbuf_getline(&line, f, '\n') == EOF ||
+	    prefixcmp(line.buf, "scan-index 1 ") ||
+	    strcmp(line.buf + 13, index_fingerprint))
+		goto out;
+	while (strbuf_getline(&line, f, '\n') != EOF) {
+		if (r) {
+			/* A repository's settings end with an empty line. */
+			if (line.len) {
+				strbuf_addbuf(&settings, &line);
+				strbuf_addch(&settings, '\n');
+				continue;
+			}
+			r->settings = strbuf_detach(&settings, NULL);
+			r = NULL;
+		} else if (!prefixcmp(line.buf, "D ") &&
+			   sscanf(line.buf + 2, "%lu %n", &mtime, &pos) == 1) {
+			d = xcalloc(1, sizeof(*d));
+			d->mtime = mtime ? mtime : -1;
+			d->subdirs.strdup_strings = 1;
+			string_list_append(&old_dirs, line.buf + 2 + pos)->util = d;
+		} else if (!prefixcmp(line.buf, "S ") && d) {
+			string_list_append(&d->subdirs, line.buf + 2);
+		} else if (!prefixcmp(line.buf, "R ")) {
+			d = NULL;
+			r = xcalloc(1, sizeof(*r));
+			string_list_append(&old_repos, line.buf + 2)->util = r;
+			if (strbuf_getline(&line, f, '\n') == EOF ||
+			    prefixcmp(line.buf, "G "))
+				break;
+			r->sig = xstrdup(line.buf + 2);
+		}
+	}
+	/* Anything cut short is scanned again. */
+	if (r) {
+		free(r->sig);
+		r->sig = xstrdup("");
+		r->settings = xstrdup("");
+	}
+	sort_string_list(&old_dirs);
+	sort_string_list(&old_repos);
+out:
+	strbuf_release(&line);
+	strbuf_release(&settings);
+	fclose(f);
+}
+
+/* Write the index of what was scanned since scan_tree_begin() to 'filename',
+ * with 'fn' writing the settings of each repository, and stop scanning
+ * incrementally. Returns 0 on success.
+ */
+int scan_tree_end(const char *filename, repo_print_fn fn)
+{
+	struct string_list_item *item, *sub;
+	struct strbuf lock = STRBUF_INIT;
+	struct scan_dir *d;
+	struct scan_repo *r;
+	int result = 0;
+	FILE *f;
+
+	strbuf_addf(&lock, "%s.lock", filename);
+	f = fopen(lock.buf, "wx");
+	if (!f) {
+		result = errno;
+		goto out;
+	}
+	fprintf(f, "scan-index 1 %s\n", index_fingerprint);
+	for_each_string_list_item(item, &new_dirs) {
+		d = item->util;
+		fprintf(f, "D %lu %s\n", d->mtime < 0 ? 0 : (unsigned long)d->mtime,
+			item->string);
+		for_each_string_list_item(sub, &d->subdirs)
+			fprintf(f, "S %s\n", sub->string);
+	}
+	for_each_string_list_item(item, &new_repos) {
+		r = item->util;
+		fprintf(f, "R %s\nG %s\n", item->string, r->sig);
+		if (r->idx >= 0)
+			fn(f, &cgit_repolist.repos[r->idx]);
+		else
+			fprintf(f, "\n");
+	}
+	if (ferror(f))
+		result = EIO;
+	if (fclose(f) && !result)
+		result = errno;
+	if (!result && rename(lock.buf, filename))
+		result = errno;
+	if (result)
+		unlink(lock.buf);
+out:
+	if (result && result != EEXIST)
+		fprintf(stderr, "[cgit] Error writing %s: %s (%d)\n",
+			filename, strerror(result), result);
+	if (result)
+		unlink(filename);
+	free_scan_index(&old_dirs, &old_repos);
+	free_scan_index(&new_dirs, &new_repos);
+	free(index_fingerprint);
+	index_fingerprint = NULL;
+	incremental = 0;
+	strbuf_release(&lock);
+	return result;
+}
+
+#ifndef NO_INOTIFY
+#include <sys/inotify.h>
+#include <poll.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* The directory of each watch descriptor, indexed by it. */
+static char **watched;
+static int watched_nr;
+
+/* Watch 'path' and every directory below it, except for repositories: they
+ * only come and go as entries of the directory holding them.
+ */
+static void watch_dir(int fd, const char *path)
+{
+	struct strbuf sub = STRBUF_INIT;
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+	int wd;
+
+	strbuf_addf(&sub, "%s/.git", path);
+	if (is_git_dir(path) || is_git_dir(sub.buf))
+		goto out;
+	wd = inotify_add_watch(fd, path, WATCH_MASK);
+	if (wd < 0) {
+		fprintf(stderr, "[cgit] Error watching %s: %s (%d)\n",
+			path, strerror(errno), errno);
+		goto out;
+	}
+	if (wd >= watched_nr) {
+		watched = xrealloc(watched, (wd + 1) * sizeof(*watched));
+		memset(watched + watched_nr, 0,
+		       (wd + 1 - watched_nr) * sizeof(*watched));
+		watched_nr = wd + 1;
+	}
+	free(watched[wd]);
+	watched[wd] = xstrdup(path);
+
+	dir = opendir(path);
+	if (!dir)
+		goto out;
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.') {
+			if (ent->d_name[1] == '\0')
+				continue;
+			if (ent->d_name[1] == '.' && ent->d_name[2] == '\0')
+				continue;
+			if (!ctx.cfg.scan_hidden_path)
+				continue;
+		}
+		strbuf_reset(&sub);
+		strbuf_addf(&sub, "%s/%s", path, ent->d_name);
+		if (!stat(sub.buf, &st) && S_ISDIR(st.st_mode))
+			watch_dir(fd, sub.buf);
+	}
 	closedir(dir);
+out:
+	strbuf_release(&sub);
+}
+
+/* Stop watching 'path' and everything below it. */
+static void unwatch_dir(int fd, const char *path)
+{
+	size_t len = strlen(path);
+	int wd;
+
+	for (wd = 0; wd < watched_nr; wd++) {
+		if (!watched[wd] || strncmp(watched[wd], path, len) ||
+		    (watched[wd][len] && watched[wd][len] != '/'))
+			continue;
+		inotify_rm_watch(fd, wd);
+		free(watched[wd]);
+		watched[wd] = NULL;
+	}
+}
+
+/* Whether the watched directory 'path' has turned into a repository (or
+ * into the .git directory of one) since it was watched. If so, 'repo' is
+ * set to the top of it.
+ */
+static int became_repo(const char *path, struct strbuf *repo)
+{
+	size_t len = strlen(path);
+
+	strbuf_reset(repo);
+	strbuf_addstr(repo, path);
+	if (is_git_dir(path)) {
+		if (len > 5 && !strcmp(path + len - 5, "/.git"))
+			strbuf_setlen(repo, len - 5);
+		return 1;
+	}
+	strbuf_addstr(repo, "/.git");
+	if (is_git_dir(repo->buf)) {
+		strbuf_setlen(repo, len);
+		return 1;
+	}
+	return 0;
+}
+
+/* Call 'fn' whenever something is created, removed or renamed below 'paths',
+ * once nothing has changed for 'delay' seconds. Only returns on errors.
+ */
+int scan_tree_watch(struct string_list *paths, int delay, void (*fn)(void))
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct string_list_item *item;
+	struct strbuf path = STRBUF_INIT;
+	struct pollfd pfd;
+	int fd, n, pending = 0, rewatch = 0;
+	ssize_t len;
+	char *p;
+
+	fd = inotify_init();
+	if (fd < 0) {
+		fprintf(stderr, "[cgit] Error initializing inotify: %s (%d)\n",
+			strerror(errno), errno);
+		return 1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	for_each_string_list_item(item, paths)
+		watch_dir(fd, item->string);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		n = poll(&pfd, 1, pending ? delay * 1000 : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "[cgit] Error waiting for changes: %s (%d)\n",
+				strerror(errno), errno);
+			break;
+		}
+		if (!n) {
+			/* Quiet for long enough, the change should be complete. */
+			if (rewatch)
+				for_each_string_list_item(item, paths)
+					watch_dir(fd, item->string);
+			fn();
+			pending = rewatch = 0;
+			continue;
+		}
+		len = xread(fd, buf, sizeof(buf));
+		if (len <= 0)
+			continue;
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* Events were lost, watch everything anew. */
+				pending = rewatch = 1;
+				continue;
+			}
+			if (ev->wd < 0 || ev->wd >= watched_nr || !watched[ev->wd])
+				continue;
+			if (ev->mask & IN_IGNORED) {
+				free(watched[ev->wd]);
+				watched[ev->wd] = NULL;
+				continue;
+			}
+			pending = 1;
+			if (became_repo(watched[ev->wd], &path)) {
+				/* A new directory turned into a repository,
+				 * what happens inside it is of no interest,
+				 * including the objects/ and refs/ watched
+				 * while it was being set up.
+				 */
+				unwatch_dir(fd, path.buf);
+			} else if (ev->len && (ev->mask & IN_ISDIR) &&
+				   (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+				strbuf_reset(&path);
+				strbuf_addf(&path, "%s/%s", watched[ev->wd], ev->name);
+				watch_dir(fd, path.buf);
+			}
+		}
+	}
+	strbuf_release(&path);
+	close(fd);
+	return 1;
+}
+#else
+int scan_tree_watch(struct string_list *paths, int delay, void (*fn)(void))
+{
+	fprintf(stderr, "[cgit] Watching scan-path needs inotify support\n");
+	return 1;
+}
+#endif
+
+#ifndef NO_PTHREADS
+static int nr_workers;
+static const char *scan_base;
+static repo_config_fn scan_fn;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int outstanding;		/* directories queued or being scanned */
+static unsigned long pushed;	/* directories queued so far */
+
+static void push_dir(struct scan_worker *w, const char *path)
+{
+	/* Counted before it can be taken, so 'outstanding' only drops to
+	 * zero once everything is scanned.
+	 */
+	pthread_mutex_lock(&idle_lock);
+	outstanding++;
+	pthread_mutex_unlock(&idle_lock);
+
+	pthread_mutex_lock(&w->lock);
+	ALLOC_GROW(w->dirs, w->nr + 1, w->alloc);
+	w->dirs[w->nr++] = xstrdup(path);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_mutex_lock(&idle_lock);
+	pushed++;
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+/* Take the newest directory of 'w' if 'newest', else the oldest. */
+static char *take_dir(struct scan_worker *w, int newest)
+{
+	char *path = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->nr)
+		path = newest ? w->dirs[--w->nr] : w->dirs[w->head++];
+	if (w->head == w->nr)
+		w->head = w->nr = 0;
+	pthread_mutex_unlock(&w->lock);
+	return path;
+}
+
+static char *next_dir(struct scan_worker *self)
+{
+	unsigned long seen;
+	char *path;
+	int i, done;
+
+	for (;;) {
+		pthread_mutex_lock(&idle_lock);
+		seen = pushed;
+		pthread_mutex_unlock(&idle_lock);
+
+		if ((path = take_dir(self, 1)))
+			return path;
+		for (i = 1; i < nr_workers; i++)
+			if ((path = take_dir(&workers[(self - workers + i) % nr_workers], 0)))
+				return path;
+
+		pthread_mutex_lock(&idle_lock);
+		while (outstanding && pushed == seen)
+			pthread_cond_wait(&idle_cond, &idle_lock);
+		done = !outstanding;
+		pthread_mutex_unlock(&idle_lock);
+		if (done)
+			return NULL;
+	}
+}
+
+static void *scan_thread(void *arg)
+{
+	struct scan_worker *self = arg;
+	char *path;
+
+	self->prober = repo_prober_new();
+	while ((path = next_dir(self))) {
+		scan_path(self, scan_base, path, scan_fn);
+		free(path);
+		pthread_mutex_lock(&idle_lock);
+		if (!--outstanding)
+			pthread_cond_broadcast(&idle_cond);
+		pthread_mutex_unlock(&idle_lock);
+	}
+	repo_prober_free(self->prober);
+	return NULL;
+}
+
+/* Scan 'paths' below 'base' with scan-threads threads. Returns nonzero if
+ * that isn't configured, then the caller has to scan serially.
+ */
+static int scan_parallel(const char *base, const struct string_list *paths,
+			 repo_config_fn fn)
+{
+	struct string_list_item *item;
+	struct scan_repo *r;
+	int i, err, *offset;
+
+	if (ctx.cfg.scan_threads <= 1)
+		return 1;
+
+	/* Borrow the next slot of cgit_repolist to learn the defaults. */
+	repo_template = *cgit_add_repo("");
+	cgit_repolist.count--;
+
+	nr_workers = ctx.cfg.scan_threads;
+	workers = xcalloc(nr_workers, sizeof(*workers));
+	for (i = 0; i < nr_workers; i++)
+		pthread_mutex_init(&workers[i].lock, NULL);
+	scan_base = base;
+	scan_fn = fn;
+	outstanding = 0;
+	for_each_string_list_item(item, paths)
+		push_dir(&workers[0], item->string);
+
+	/* The calling thread is the first worker, the others just help. */
+	for (i = 1; i < nr_workers; i++) {
+		err = pthread_create(&workers[i].thread, NULL, scan_thread,
+				     &workers[i]);
+		if (err)
+			fprintf(stderr, "[cgit] Error starting scan thread: %s (%d)\n",
+				strerror(err), err);
+		else
+			workers[i].started = 1;
+	}
+	scan_thread(&workers[0]);
+	for (i = 1; i < nr_workers; i++)
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+
+	offset = xcalloc(nr_workers, sizeof(*offset));
+	for (i = 0; i < nr_workers; i++) {
+		offset[i] = cgit_repolist.count;
+		if (cgit_repolist.length < cgit_repolist.count + workers[i].repos_nr) {
+			cgit_repolist.length = cgit_repolist.count + workers[i].repos_nr;
+			cgit_repolist.repos = xrealloc(cgit_repolist.repos,
+						       cgit_repolist.length *
+						       sizeof(struct cgit_repo));
+		}
+		memcpy(cgit_repolist.repos + cgit_repolist.count, workers[i].repos,
+		       workers[i].repos_nr * sizeof(struct cgit_repo));
+		cgit_repolist.count += workers[i].repos_nr;
+		free(workers[i].repos);
+		free(workers[i].dirs);
+		pthread_mutex_destroy(&workers[i].lock);
+	}
+	for_each_string_list_item(item, &new_repos) {
+		r = item->util;
+		if (r->worker < 0)
+			continue;
+		if (r->idx >= 0)
+			r->idx += offset[r->worker];
+		r->worker = -1;
+	}
+	free(offset);
+	free(workers);
+	workers = NULL;
+	return 0;
+}
+#else
+static void push_dir(struct scan_worker *w, const char *path)
+{
 }
 
+static int scan_parallel(const char *base, const struct string_list *paths,
+			 repo_config_fn fn)
+{
+	return 1;
+}
+#endif
+
 #define lastc(s) s[strlen(s) - 1]
 
 void scan_projects(const char *path, const char *projectsfile, repo_config_fn fn)
 {
 	struct strbuf line = STRBUF_INIT;
+	struct string_list dirs = STRING_LIST_INIT_DUP;
+	struct string_list_item *item;
 	FILE *projects;
 	int err;
 	projects = fopen(projectsfile, "r");
@@ -253,51 +1136,87 @@ void scan_projects(const char *path, const char *projectsfile, repo_config_fn fn
 			continue;
 		strbuf_insert(&line, 0, "/", 1);
 		strbuf_insert(&line, 0, path, strlen(path));
-		scan_path(path, line.buf, fn);
+		string_list_append(&dirs, line.buf);
 	}
 	if ((err = ferror(projects))) {
 		fprintf(stderr, "Error reading from projectsfile %s: %s (%d)\n", projectsfile, strerror(err), err);
 	}
 	fclose(projects);
 	strbuf_release(&line);
+
+	if (scan_parallel(path, &dirs, fn)) {
+		serial_prober = repo_prober_new();
+		for_each_string_list_item(item, &dirs)
+			scan_path(NULL, path, item->string, fn);
+		repo_prober_free(serial_prober);
+		serial_prober = NULL;
+	}
+	string_list_clear(&dirs, 0);
 }
 
 void scan_tree(const char *path, repo_config_fn fn)
 {
-	scan_path(path, path, fn);
-}
-
-int gerrit_scan_projects(const char *path, const char *data, repo_config_fn fn) {
-    json_error_t error;
-    //json_t * root = json_load_file("./project-list.json", 0,  &error);
-    json_t * root = json_loads(data, 0, &error);
-
-    if(!root) {
-        fprintf(stderr, "error: on line %d: %s\n", error.line, error.text);
-        if(data) {
-          fprintf(stderr, "error: data: %s\n", data);
-        }
-        return 1;
-    }
-
-    const char *key;
-    json_t *value;
-
-    void *iter = json_object_iter(root);
-    while(iter)
-    {
-        key = json_object_iter_key(iter);
-        value = json_object_iter_value(iter);
-        char * repodir = (char *)malloc(strlen(path) + strlen(key) + 10);
-        sprintf(repodir,"%s/%s.git", path, key);
-        scan_path(path, repodir, fn);
-				free(repodir);
-        //strbuf_addstr(&line,key);
-        //strbuf_insert(&line, 0, "/", 1);
-        //strbuf_insert(&line, 0, path, strlen(path));
-        //scan_path(path, line.buf, fn);
-        iter = json_object_iter_next(root, iter);
-    }
-    return 0;
+	struct string_list dirs = STRING_LIST_INIT_NODUP;
+
+	string_list_append(&dirs, path);
+	if (scan_parallel(path, &dirs, fn)) {
+		serial_prober = repo_prober_new();
+		scan_path(NULL, path, path, fn);
+		repo_prober_free(serial_prober);
+		serial_prober = NULL;
+	}
+	string_list_clear(&dirs, 0);
+}
+
+int gerrit_scan_projects(const char *path, const struct string_list *projects,
+			 repo_config_fn fn)
+{
+	struct string_list_item *item;
+	struct strbuf repodir = STRBUF_INIT;
+
+	for_each_string_list_item(item, projects) {
+		strbuf_reset(&repodir);
+		strbuf_addf(&repodir, "%s/%s.git", path, item->string);
+		scan_path(NULL, path, repodir.buf, fn);
+	}
+	strbuf_release(&repodir);
+	return 0;
+}
+
+/* Drop every repository from cgit_repolist.repos[start..] which is not in
+ * the Gerrit project list 'projects'. Projects are matched on the repo url
+ * with any ".git" suffix removed.
+ */
+int gerrit_filter_projects(const struct string_list *projects, int start)
+{
+	struct string_list visible = STRING_LIST_INIT_NODUP;
+	struct string_list_item *item;
+	struct strbuf url = STRBUF_INIT;
+	struct cgit_repo *repo;
+	int i, n;
+
+	for_each_string_list_item(item, projects)
+		string_list_append(&visible, item->string);
+	sort_string_list(&visible);
+
+	n = start;
+	for (i = start; i < cgit_repolist.count; i++) {
+		repo = &cgit_repolist.repos[i];
+		strbuf_reset(&url);
+		strbuf_addstr(&url, repo->url);
+		if (url.len > 4 && !strcmp(url.buf + url.len - 4, ".git"))
+			strbuf_setlen(&url, url.len - 4);
+		if (!string_list_has_string(&visible, url.buf))
+			continue;
+		if (n != i)
+			cgit_repolist.repos[n] = *repo;
+		n++;
+	}
+	cgit_repolist.count = n;
+	cgit_repo_index_reset();
+
+	string_list_clear(&visible, 0);
+	strbuf_release(&url);
+	return 0;
 }
 /* //CHERRY */
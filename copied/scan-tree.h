@@ -4,6 +4,14 @@
 #include "cgit.h"
 extern void scan_projects(const char *path, const char *projectsfile, repo_config_fn fn);
 extern void scan_tree(const char *path, repo_config_fn fn);
-extern int gerrit_scan_projects(const char *path, const char *data, repo_config_fn fn); 
+extern void scan_tree_load(struct cgit_repo *repo);
+extern void scan_tree_load_all(void);
+typedef void (*repo_print_fn)(FILE *f, struct cgit_repo *repo);
+extern void scan_tree_begin(const char *filename);
+extern int scan_tree_end(const char *filename, repo_print_fn fn);
+extern int scan_tree_watch(struct string_list *paths, int delay, void (*fn)(void));
+extern int gerrit_scan_projects(const char *path, const struct string_list *projects,
+				repo_config_fn fn);
+extern int gerrit_filter_projects(const struct string_list *projects, int start);
 
 #endif
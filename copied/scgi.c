@@ -0,0 +1,123 @@
+/* scgi.c: accept requests from the webserver over the SCGI protocol
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+#include "cgit.h"
+#include "scgi.h"
+
+/* An SCGI request starts with a netstring of NUL separated name/value pairs,
+ * which cgit treats exactly like the environment of a CGI request.
+ */
+#define SCGI_MAX_HEADERS (1024 * 1024)
+#define SCGI_READ_TIMEOUT 30
+
+/* Names set for the previous request, they must not leak into the next. */
+static struct string_list request_env = STRING_LIST_INIT_DUP;
+
+int scgi_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd, err;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, SOMAXCONN)) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	/* Filters are exec'd from request children, keep the socket away. */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	/* All workers of a pool wait on the socket, only one gets to accept
+	 * a connection and the others must not block.
+	 */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static int read_headers(int fd, struct strbuf *headers)
+{
+	size_t len = 0;
+	char c;
+
+	for (;;) {
+		if (xread(fd, &c, 1) != 1)
+			return -1;
+		if (c == ':')
+			break;
+		if (!isdigit(c) || len > SCGI_MAX_HEADERS)
+			return -1;
+		len = len * 10 + c - '0';
+	}
+	/* The headers are followed by a ',' which ends the netstring. */
+	strbuf_grow(headers, len + 1);
+	if (read_in_full(fd, headers->buf, len + 1) != len + 1 ||
+	    headers->buf[len] != ',')
+		return -1;
+	strbuf_setlen(headers, len);
+	return 0;
+}
+
+static void set_request_env(const struct strbuf *headers)
+{
+	struct string_list_item *item;
+	const char *name, *value, *end = headers->buf + headers->len;
+
+	for_each_string_list_item(item, &request_env)
+		unsetenv(item->string);
+	string_list_clear(&request_env, 0);
+
+	for (name = headers->buf; name < end; name = value + strlen(value) + 1) {
+		value = name + strlen(name) + 1;
+		if (value >= end)
+			break;
+		if (!*name || strchr(name, '='))
+			continue;
+		setenv(name, value, 1);
+		string_list_append(&request_env, name);
+	}
+}
+
+/* Wait for the next request on 'listen_fd', set up the environment from its
+ * headers and return the connection, which receives the CGI style response.
+ */
+int scgi_accept(int listen_fd)
+{
+	struct strbuf headers = STRBUF_INIT;
+	struct timeval tv;
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return -1;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	/* Don't let a stalled client block this worker forever. */
+	tv.tv_sec = SCGI_READ_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (read_headers(fd, &headers)) {
+		fprintf(stderr, "[cgit] Malformed SCGI request\n");
+		strbuf_release(&headers);
+		close(fd);
+		errno = EPROTO;
+		return -1;
+	}
+	set_request_env(&headers);
+	strbuf_release(&headers);
+	return fd;
+}
@@ -0,0 +1,7 @@
+#ifndef SCGI_H
+#define SCGI_H
+
+extern int scgi_listen(const char *path);
+extern int scgi_accept(int listen_fd);
+
+#endif /* SCGI_H */
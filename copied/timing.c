@@ -0,0 +1,159 @@
+/* timing.c: time spent in the phases of a request
+ *
+ * Licensed under GNU General Public License v2
+ *   (see COPYING for full license text)
+ */
+
+#include "cgit.h"
+#include "timing.h"
+
+static const char *phase_names[TIMING_MAX] = {
+	"config", "gerrit", "scan", "cache", "prepare", "render"
+};
+
+static struct {
+	struct timespec start;
+	struct timespec begun[TIMING_MAX];
+	uint64_t ns[TIMING_MAX];
+	unsigned runs[TIMING_MAX];
+	int active[TIMING_MAX];
+	int started;
+	int deferred;
+} timing;
+
+static uint64_t elapsed(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000000ULL +
+		now.tv_nsec - since->tv_nsec;
+}
+
+void timing_start(void)
+{
+	memset(&timing, 0, sizeof(timing));
+	clock_gettime(CLOCK_MONOTONIC, &timing.start);
+	timing.started = 1;
+}
+
+void timing_begin(enum timing_phase phase)
+{
+	clock_gettime(CLOCK_MONOTONIC, &timing.begun[phase]);
+	timing.active[phase] = 1;
+}
+
+uint64_t timing_end(enum timing_phase phase)
+{
+	uint64_t ns = elapsed(&timing.begun[phase]);
+
+	timing.ns[phase] += ns;
+	timing.runs[phase]++;
+	timing.active[phase] = 0;
+	return ns;
+}
+
+void timing_defer(int defer)
+{
+	timing.deferred = defer;
+}
+
+int timing_deferred(void)
+{
+	return timing.deferred;
+}
+
+/* Whether the page was served from the cache, rendered for it, or the
+ * cache is off.
+ */
+const char *timing_cache_result(void)
+{
+	if (!ctx.cfg.cache_size)
+		return "none";
+	return timing.runs[TIMING_RENDER] ? "miss" : "hit";
+}
+
+static uint64_t phase_ns(enum timing_phase phase)
+{
+	uint64_t ns = timing.ns[phase];
+
+	/* The header of a buffered page is made while the cache runs. */
+	if (timing.active[phase])
+		ns += elapsed(&timing.begun[phase]);
+	return ns;
+}
+
+/* The time of 'phase' in milliseconds. The cache phase wraps rendering a
+ * page that wasn't cached, which is left out of it.
+ */
+static double phase_ms(enum timing_phase phase)
+{
+	uint64_t ns = phase_ns(phase);
+	uint64_t inner = phase_ns(TIMING_PREPARE) + phase_ns(TIMING_RENDER);
+
+	if (phase == TIMING_CACHE)
+		ns = ns > inner ? ns - inner : 0;
+	return ns / 1e6;
+}
+
+int timing_client_allowed(const char *list)
+{
+	const char *addr = getenv("REMOTE_ADDR");
+	const char *p = list;
+	size_t len;
+
+	if (!p || !addr)
+		return 0;
+	for (p += strspn(p, " \t,"); *p; p += strspn(p, " \t,")) {
+		len = strcspn(p, " \t,");
+		if (len == 1 && *p == '*')
+			return 1;
+		if (!strncmp(addr, p, len) &&
+		    (!addr[len] || p[len - 1] == '.' || p[len - 1] == ':'))
+			return 1;
+		p += len;
+	}
+	return 0;
+}
+
+void timing_header(struct strbuf *sb)
+{
+	int i;
+
+	if (!ctx.cfg.server_timing || !timing.started ||
+	    !timing_client_allowed(ctx.cfg.server_timing_allow))
+		return;
+	strbuf_addstr(sb, "Server-Timing: ");
+	for (i = 0; i < TIMING_MAX; i++) {
+		strbuf_addf(sb, "%s;dur=%.3f", phase_names[i], phase_ms(i));
+		if (i == TIMING_CACHE)
+			strbuf_addf(sb, ";desc=%s", timing_cache_result());
+		strbuf_addstr(sb, ", ");
+	}
+	strbuf_addf(sb, "total;dur=%.3f\n", elapsed(&timing.start) / 1e6);
+}
+
+uint64_t timing_total(void)
+{
+	return timing.started ? elapsed(&timing.start) : 0;
+}
+
+void timing_log(void)
+{
+	const char *page;
+	int i;
+
+	if (!ctx.cfg.server_timing || !timing.started)
+		return;
+	if (ctx.qry.page)
+		page = ctx.qry.page;
+	else
+		page = ctx.repo ? "summary" : "repolist";
+	/* The url goes last, bench-replay.sh reads the fields before it. */
+	fprintf(stderr, "[cgit] timing page=%s cached=%s", page,
+		timing_cache_result());
+	for (i = 0; i < TIMING_MAX; i++)
+		fprintf(stderr, " %s=%.3f", phase_names[i], phase_ms(i));
+	fprintf(stderr, " total=%.3f url=%s\n", elapsed(&timing.start) / 1e6,
+		ctx.qry.raw ? ctx.qry.raw : "");
+}
@@ -0,0 +1,48 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include "cgit.h"
+
+/*
+ * Where a request spends its time, taken from the monotonic clock. Phases
+ * may nest (config covers the scan and the Gerrit calls it makes) and may
+ * run more than once, their times add up. With server-timing set, the
+ * phases go into a Server-Timing header for the clients listed in
+ * server-timing-allow and into a line in the error log.
+ */
+enum timing_phase {
+	TIMING_CONFIG,
+	TIMING_GERRIT,
+	TIMING_SCAN,
+	TIMING_CACHE,
+	TIMING_PREPARE,
+	TIMING_RENDER,
+	TIMING_MAX
+};
+
+extern void timing_start(void);
+extern void timing_begin(enum timing_phase phase);
+/* Returns how long this run of 'phase' took, in nanoseconds. */
+extern uint64_t timing_end(enum timing_phase phase);
+
+/* While set, cgit_print_http_headers() leaves the header out: the output
+ * is captured and the header is added when it is sent, or it goes into a
+ * cache slot, see page-cache.c.
+ */
+extern void timing_defer(int defer);
+extern int timing_deferred(void);
+
+/* Append the Server-Timing header line if the client may see it. */
+extern void timing_header(struct strbuf *sb);
+extern void timing_log(void);
+
+/* Nanoseconds since timing_start(), and "hit", "miss" or "none". */
+extern uint64_t timing_total(void);
+extern const char *timing_cache_result(void);
+
+/* Whether REMOTE_ADDR is in 'list': addresses, prefixes of them ending in
+ * '.' or ':' (such as "10.0."), or "*" for every client.
+ */
+extern int timing_client_allowed(const char *list);
+
+#endif /* TIMING_H */
@@ -10,6 +10,7 @@
 #include "ui-shared.h"
 #include "cmd.h"
 #include "html.h"
+#include "timing.h"
 
 const char cgit_doctype[] =
 /* cherrysis
@@ -145,7 +146,8 @@ static void site_url(const char *page, const char *search, const char *sort, int
 		html(ctx.cfg.script_name);
 
 	if (page) {
-		htmlf("?p=%s", page);
+		html("?p=");
+		html(page);
 		delim = "&amp;";
 	}
 	if (search) {
@@ -193,6 +195,61 @@ void cgit_index_link(const char *name, const char *title, const char *class,
 	site_link(NULL, name, title, class, pattern, sort, ofs);
 }
 
+/* Escape 'txt' into 'sb' like html_url_path() (or html_url_arg() if 'arg'
+ * is set) would print it.
+ */
+static void add_url_escaped(struct strbuf *sb, const char *txt, int arg)
+{
+	unsigned char c;
+
+	for (; *txt; txt++) {
+		c = *txt;
+		if (arg && c == ' ')
+			strbuf_addch(sb, '+');
+		else if (c <= ' ' || c >= 0x7f || strchr("\"#%'?", c) ||
+			 (arg && (c == '+' || c == '&')))
+			strbuf_addf(sb, "%%%02x", c);
+		else
+			strbuf_addch(sb, c);
+	}
+}
+
+/* The start of every link into the current repository, up to and
+ * including the '/' after its url. A log page prints hundreds of links, so
+ * the url is escaped once and kept until the repository or the root
+ * changes.
+ */
+static const char *repo_base(void)
+{
+	static struct {
+		const struct cgit_repo *repo;
+		const char *url;
+		const char *root;
+		struct strbuf buf;
+	} base = { NULL, NULL, NULL, STRBUF_INIT };
+	const char *root = ctx.cfg.virtual_root ? ctx.cfg.virtual_root
+						: ctx.cfg.script_name;
+
+	if (base.repo == ctx.repo && base.url == ctx.repo->url &&
+	    base.root == root)
+		return base.buf.buf;
+	strbuf_reset(&base.buf);
+	if (ctx.cfg.virtual_root) {
+		add_url_escaped(&base.buf, ctx.cfg.virtual_root, 0);
+		add_url_escaped(&base.buf, ctx.repo->url, 0);
+	} else {
+		strbuf_addstr(&base.buf, ctx.cfg.script_name);
+		strbuf_addstr(&base.buf, "?url=");
+		add_url_escaped(&base.buf, ctx.repo->url, 1);
+	}
+	if (ctx.repo->url[strlen(ctx.repo->url) - 1] != '/')
+		strbuf_addch(&base.buf, '/');
+	base.repo = ctx.repo;
+	base.url = ctx.repo->url;
+	base.root = root;
+	return base.buf.buf;
+}
+
 static char *repolink(const char *title, const char *class, const char *page,
 		      const char *head, const char *path)
 {
@@ -210,11 +267,8 @@ static char *repolink(const char *title, const char *class, const char *page,
 		html("'");
 	}
 	html(" href='");
+	html(repo_base());
 	if (ctx.cfg.virtual_root) {
-		html_url_path(ctx.cfg.virtual_root);
-		html_url_path(ctx.repo->url);
-		if (ctx.repo->url[strlen(ctx.repo->url) - 1] != '/')
-			html("/");
 		if (page) {
 			html_url_path(page);
 			html("/");
@@ -222,11 +276,6 @@ static char *repolink(const char *title, const char *class, const char *page,
 				html_url_path(path);
 		}
 	} else {
-		html(ctx.cfg.script_name);
-		html("?url=");
-		html_url_arg(ctx.repo->url);
-		if (ctx.repo->url[strlen(ctx.repo->url) - 1] != '/')
-			html("/");
 		if (page) {
 			html_url_arg(page);
 			html("/");
@@ -241,7 +290,7 @@ static char *repolink(const char *title, const char *class, const char *page,
 		html_url_arg(head);
 		delim = "&amp;";
 	}
-	return fmt("%s", delim);
+	return delim;
 }
 
 static void reporevlink(const char *page, const char *name, const char *title,
@@ -634,20 +683,30 @@ void cgit_print_http_headers(struct cgit_context *ctx)
 
 	if (ctx->page.status)
 		htmlf("Status: %d %s\n", ctx->page.status, ctx->page.statusmsg);
-	if (ctx->page.mimetype && ctx->page.charset)
+	/* A 304 has no body to describe, only validators. */
+	if (ctx->page.status == 304)
+		;
+	else if (ctx->page.mimetype && ctx->page.charset)
 		htmlf("Content-Type: %s; charset=%s\n", ctx->page.mimetype,
 		      ctx->page.charset);
 	else if (ctx->page.mimetype)
 		htmlf("Content-Type: %s\n", ctx->page.mimetype);
-	if (ctx->page.size)
+	if (ctx->page.size && ctx->page.status != 304)
 		htmlf("Content-Length: %zd\n", ctx->page.size);
-	if (ctx->page.filename)
+	if (ctx->page.filename && ctx->page.status != 304)
 		htmlf("Content-Disposition: inline; filename=\"%s\"\n",
 		      ctx->page.filename);
 	htmlf("Last-Modified: %s\n", http_date(ctx->page.modified));
 	htmlf("Expires: %s\n", http_date(ctx->page.expires));
 	if (ctx->page.etag)
 		htmlf("ETag: \"%s\"\n", ctx->page.etag);
+	if (!timing_deferred()) {
+		struct strbuf timing = STRBUF_INIT;
+
+		timing_header(&timing);
+		html(timing.buf);
+		strbuf_release(&timing);
+	}
 	html("\n");
 	if (ctx->env.request_method && !strcmp(ctx->env.request_method, "HEAD"))
 		exit(0);